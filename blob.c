@@ -18,15 +18,49 @@
 
 #include "blob.h"
 
+#define BLOB_PAD(len)	(((len) + BLOB_ATTR_ALIGN - 1) & ~(BLOB_ATTR_ALIGN - 1))
+
 static bool
 blob_buffer_grow(struct blob_buf *buf, int minlen)
 {
 	int delta = ((minlen / 256) + 1) * 256;
+	void *new;
+
+	/* grow by at least half the size, to keep building large messages linear */
+	if (delta < buf->buflen / 2)
+		delta = BLOB_PAD(buf->buflen / 2);
+
+	/* no need to clear the new space, everything added is initialized */
+	new = realloc(buf->buf, buf->buflen + delta);
+	if (!new)
+		return false;
+
+	buf->buf = new;
 	buf->buflen += delta;
-	buf->buf = realloc(buf->buf, buf->buflen);
+	return true;
+}
+
+/* caller provided storage: move to the heap once it is too small */
+static bool
+blob_buffer_grow_external(struct blob_buf *buf, int minlen)
+{
+	int delta = ((minlen / 256) + 1) * 256;
+	void *new;
+
+	if (delta < buf->buflen / 2)
+		delta = BLOB_PAD(buf->buflen / 2);
+
+	new = malloc(buf->buflen + delta);
+	if (!new)
+		return false;
+
 	if (buf->buf)
-		memset(buf->buf + buf->buflen - delta, 0, delta);
-	return !!buf->buf;
+		memcpy(new, buf->buf, buf->buflen);
+
+	buf->grow = blob_buffer_grow;
+	buf->buf = new;
+	buf->buflen += delta;
+	return true;
 }
 
 static void
@@ -50,26 +84,41 @@ attr_to_offset(struct blob_buf *buf, struct blob_attr *attr)
 	return (char *)attr - (char *) buf->buf + BLOB_COOKIE;
 }
 
-void
+bool
 blob_buf_grow(struct blob_buf *buf, int required)
 {
 	int offset_head = attr_to_offset(buf, buf->head);
 
 	if (!buf->grow || !buf->grow(buf, required))
-		return;
+		return false;
 
 	buf->head = offset_to_attr(buf, offset_head);
+	return true;
+}
+
+bool
+blob_buf_reserve(struct blob_buf *buf, int len)
+{
+	int offset = attr_to_offset(buf, blob_next(buf->head)) - BLOB_COOKIE;
+	int required = offset + len - buf->buflen;
+
+	if (required <= 0)
+		return true;
+
+	return blob_buf_grow(buf, required);
 }
 
 static struct blob_attr *
 blob_add(struct blob_buf *buf, struct blob_attr *pos, int id, int payload)
 {
 	int offset = attr_to_offset(buf, pos);
-	int required = (offset - BLOB_COOKIE + sizeof(struct blob_attr) + payload) - buf->buflen;
+	int required = (offset - BLOB_COOKIE + BLOB_PAD(sizeof(struct blob_attr) + payload)) - buf->buflen;
 	struct blob_attr *attr;
 
 	if (required > 0) {
-		blob_buf_grow(buf, required);
+		if (!blob_buf_grow(buf, required))
+			return NULL;
+
 		attr = offset_to_attr(buf, offset);
 	} else {
 		attr = pos;
@@ -93,10 +142,56 @@ blob_buf_init(struct blob_buf *buf, int id)
 	return 0;
 }
 
+int
+blob_buf_init_external(struct blob_buf *buf, int id, void *storage, int len)
+{
+	buf->grow = blob_buffer_grow_external;
+	buf->buf = storage;
+	/* only whole alignment units, the padding is written too */
+	buf->buflen = storage ? len & ~(BLOB_ATTR_ALIGN - 1) : 0;
+
+	return blob_buf_init(buf, id);
+}
+
+bool
+blob_buf_is_external(struct blob_buf *buf)
+{
+	return buf->grow == blob_buffer_grow_external;
+}
+
+int
+blob_buf_reset(struct blob_buf *buf)
+{
+	if (!buf->buf)
+		return blob_buf_init(buf, 0);
+
+	return blob_buf_init(buf, blob_id(buf->buf));
+}
+
+void
+blob_buf_shrink(struct blob_buf *buf)
+{
+	int offset_head = attr_to_offset(buf, buf->head);
+	int len = attr_to_offset(buf, blob_next(buf->head)) - BLOB_COOKIE;
+	void *new;
+
+	if (blob_buf_is_external(buf) || len >= buf->buflen)
+		return;
+
+	new = realloc(buf->buf, len);
+	if (!new)
+		return;
+
+	buf->buf = new;
+	buf->buflen = len;
+	buf->head = offset_to_attr(buf, offset_head);
+}
+
 void
 blob_buf_free(struct blob_buf *buf)
 {
-	free(buf->buf);
+	if (!blob_buf_is_external(buf))
+		free(buf->buf);
 	buf->buf = NULL;
 	buf->buflen = 0;
 }
@@ -142,6 +237,9 @@ blob_put_raw(struct blob_buf *buf, const void *ptr, int len)
 		return NULL;
 
 	attr = blob_add(buf, blob_next(buf->head), 0, len - sizeof(struct blob_attr));
+	if (!attr)
+		return NULL;
+
 	blob_set_raw_len(buf->head, blob_pad_len(buf->head) + len);
 	memcpy(attr, ptr, len);
 	return attr;
@@ -183,6 +281,7 @@ static const int blob_type_minlen[BLOB_ATTR_LAST] = {
 	[BLOB_ATTR_INT16] = sizeof(uint16_t),
 	[BLOB_ATTR_INT32] = sizeof(uint32_t),
 	[BLOB_ATTR_INT64] = sizeof(uint64_t),
+	[BLOB_ATTR_DOUBLE] = sizeof(double),
 };
 
 bool
@@ -193,7 +292,7 @@ blob_check_type(const void *ptr, int len, int type)
 	if (type >= BLOB_ATTR_LAST)
 		return false;
 
-	if (type >= BLOB_ATTR_INT8 && type <= BLOB_ATTR_INT64) {
+	if (type >= BLOB_ATTR_INT8 && type <= BLOB_ATTR_DOUBLE) {
 		if (len != blob_type_minlen[type])
 			return false;
 	} else {
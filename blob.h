@@ -39,6 +39,7 @@ enum {
 	BLOB_ATTR_INT16,
 	BLOB_ATTR_INT32,
 	BLOB_ATTR_INT64,
+	BLOB_ATTR_DOUBLE,
 	BLOB_ATTR_LAST
 };
 
@@ -191,7 +192,33 @@ extern void blob_set_raw_len(struct blob_attr *attr, unsigned int len);
 extern bool blob_attr_equal(const struct blob_attr *a1, const struct blob_attr *a2);
 extern int blob_buf_init(struct blob_buf *buf, int id);
 extern void blob_buf_free(struct blob_buf *buf);
-extern void blob_buf_grow(struct blob_buf *buf, int required);
+
+/*
+ * blob_buf_init_external: initialize buf with caller provided storage
+ * (e.g. a stack array, 4 byte aligned). once the storage is too small, the
+ * data is moved to a heap buffer, which blob_buf_free releases as usual.
+ */
+extern int blob_buf_init_external(struct blob_buf *buf, int id, void *storage, int len);
+
+/* blob_buf_is_external: true while buf still uses caller provided storage */
+extern bool blob_buf_is_external(struct blob_buf *buf);
+
+/*
+ * blob_buf_reset: remove all attributes, keeping the allocated buffer and
+ * the id of the root attribute
+ */
+extern int blob_buf_reset(struct blob_buf *buf);
+
+/* blob_buf_shrink: release unused buffer space (heap buffers only) */
+extern void blob_buf_shrink(struct blob_buf *buf);
+extern bool blob_buf_grow(struct blob_buf *buf, int required);
+
+/*
+ * blob_buf_reserve: make room for len more bytes of attributes (incl. headers)
+ * after the data already in buf, to avoid growing the buffer step by step.
+ * must be called after blob_buf_init.
+ */
+extern bool blob_buf_reserve(struct blob_buf *buf, int len);
 extern struct blob_attr *blob_new(struct blob_buf *buf, int id, int payload);
 extern void *blob_nest_start(struct blob_buf *buf, int id);
 extern void blob_nest_end(struct blob_buf *buf, void *cookie);
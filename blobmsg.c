@@ -20,6 +20,7 @@ static const int blob_type[__BLOBMSG_TYPE_LAST] = {
 	[BLOBMSG_TYPE_INT16] = BLOB_ATTR_INT16,
 	[BLOBMSG_TYPE_INT32] = BLOB_ATTR_INT32,
 	[BLOBMSG_TYPE_INT64] = BLOB_ATTR_INT64,
+	[BLOBMSG_TYPE_DOUBLE] = BLOB_ATTR_DOUBLE,
 	[BLOBMSG_TYPE_STRING] = BLOB_ATTR_STRING,
 	[BLOBMSG_TYPE_UNSPEC] = BLOB_ATTR_BINARY,
 };
@@ -163,6 +164,354 @@ int blobmsg_parse(const struct blobmsg_policy *policy, int policy_len,
 	return 0;
 }
 
+struct blobmsg_policy_slot {
+	uint32_t hash;
+	uint16_t namelen;
+	int16_t index;		/* first policy entry with this name, -1: unused */
+};
+
+struct blobmsg_compiled_policy {
+	const struct blobmsg_policy *policy;
+	int policy_len;
+	unsigned int mask;
+
+	/*
+	 * types of the policy entries by name length, blobmsg_parse validates
+	 * every attribute for which an entry with the same type and name
+	 * length exists, even if the name itself does not match
+	 */
+	int max_namelen;
+	uint32_t *len_types;
+
+	/* next policy entry with the same name, -1 at the end */
+	int16_t *next;
+	struct blobmsg_policy_slot slots[];
+};
+
+static uint32_t
+blobmsg_name_hash(const uint8_t *name, int len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len-- > 0) {
+		hash ^= *(name++);
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static const struct blobmsg_policy_slot *
+blobmsg_policy_lookup(const struct blobmsg_compiled_policy *cp,
+		      const uint8_t *name, int len, uint32_t hash)
+{
+	const struct blobmsg_policy_slot *slot;
+	unsigned int i;
+
+	for (i = hash & cp->mask; ; i = (i + 1) & cp->mask) {
+		slot = &cp->slots[i];
+		if (slot->index < 0)
+			return slot;
+
+		if (slot->hash == hash && slot->namelen == len &&
+		    !memcmp(cp->policy[slot->index].name, name, len))
+			return slot;
+	}
+}
+
+/* ids past the blobmsg types only match BLOBMSG_TYPE_UNSPEC entries */
+static inline uint32_t blobmsg_type_bit(int id)
+{
+	return 1U << (id < 31 ? id : 31);
+}
+
+struct blobmsg_compiled_policy *
+blobmsg_policy_compile(const struct blobmsg_policy *policy, int policy_len)
+{
+	struct blobmsg_compiled_policy *cp;
+	struct blobmsg_policy_slot *slot;
+	unsigned int size = 8;
+	uint32_t hash;
+	int max_namelen = 0;
+	int i, j, len;
+
+	if (policy_len < 0 || policy_len > INT16_MAX)
+		return NULL;
+
+	/* keep the table at most half full */
+	while (size < 2 * policy_len)
+		size <<= 1;
+
+	for (i = 0; i < policy_len; i++) {
+		if (!policy[i].name)
+			continue;
+
+		len = strlen(policy[i].name);
+		if (len > max_namelen)
+			max_namelen = len;
+	}
+
+	cp = calloc(1, sizeof(*cp) + size * sizeof(cp->slots[0]) +
+		    (max_namelen + 1) * sizeof(cp->len_types[0]) +
+		    policy_len * sizeof(cp->next[0]));
+	if (!cp)
+		return NULL;
+
+	cp->policy = policy;
+	cp->policy_len = policy_len;
+	cp->mask = size - 1;
+	cp->max_namelen = max_namelen;
+	cp->len_types = (uint32_t *) &cp->slots[size];
+	cp->next = (int16_t *) &cp->len_types[max_namelen + 1];
+	for (i = 0; i < size; i++)
+		cp->slots[i].index = -1;
+
+	for (i = 0; i < policy_len; i++) {
+		cp->next[i] = -1;
+		if (!policy[i].name)
+			continue;
+
+		len = strlen(policy[i].name);
+		if (policy[i].type == BLOBMSG_TYPE_UNSPEC)
+			cp->len_types[len] = ~0;
+		else
+			cp->len_types[len] |= blobmsg_type_bit(policy[i].type);
+
+		hash = blobmsg_name_hash((const uint8_t *) policy[i].name, len);
+		slot = (struct blobmsg_policy_slot *)
+			blobmsg_policy_lookup(cp, (const uint8_t *) policy[i].name, len, hash);
+		if (slot->index < 0) {
+			slot->hash = hash;
+			slot->namelen = len;
+			slot->index = i;
+			continue;
+		}
+
+		/* same name as an earlier entry, e.g. with a different type */
+		for (j = slot->index; cp->next[j] >= 0; j = cp->next[j])
+			;
+		cp->next[j] = i;
+	}
+
+	return cp;
+}
+
+void blobmsg_policy_compiled_free(struct blobmsg_compiled_policy *cp)
+{
+	free(cp);
+}
+
+/*
+ * validate the attribute where blobmsg_parse would and look up the first
+ * policy entry with its name.
+ * returns the entry, -1 if there is none or -2 if the attribute is invalid
+ */
+static int
+blobmsg_policy_find(const struct blobmsg_compiled_policy *cp, struct blob_attr *attr)
+{
+	struct blobmsg_hdr *hdr;
+	int namelen;
+
+	if (blob_len(attr) < sizeof(struct blobmsg_hdr))
+		return -2;
+
+	hdr = blob_data(attr);
+	namelen = blobmsg_namelen(hdr);
+	if (namelen > cp->max_namelen ||
+	    !(cp->len_types[namelen] & blobmsg_type_bit(blob_id(attr))))
+		return -1;
+
+	if (!blobmsg_check_attr(attr, true))
+		return -2;
+
+	return blobmsg_policy_lookup(cp, hdr->name, namelen,
+				     blobmsg_name_hash(hdr->name, namelen))->index;
+}
+
+int blobmsg_parse_compiled(const struct blobmsg_compiled_policy *cp,
+			   struct blob_attr **tb, void *data, int len)
+{
+	const struct blobmsg_policy *policy = cp->policy;
+	struct blob_attr *attr;
+	int i;
+
+	memset(tb, 0, cp->policy_len * sizeof(*tb));
+	__blob_for_each_attr(attr, data, len) {
+		i = blobmsg_policy_find(cp, attr);
+		if (i < -1)
+			return -1;
+
+		for (; i >= 0; i = cp->next[i]) {
+			if (policy[i].type != BLOBMSG_TYPE_UNSPEC &&
+			    blob_id(attr) != policy[i].type)
+				continue;
+
+			if (!tb[i])
+				tb[i] = attr;
+		}
+	}
+
+	return 0;
+}
+
+struct blobmsg_decoder {
+	const struct blobmsg_field *fields;
+	struct blobmsg_compiled_policy *cp;
+	struct blobmsg_policy policy[];
+};
+
+struct blobmsg_decoder *
+blobmsg_decoder_new(const struct blobmsg_field *fields, int n_fields)
+{
+	struct blobmsg_decoder *d;
+	int i;
+
+	if (n_fields < 0)
+		return NULL;
+
+	d = calloc(1, sizeof(*d) + n_fields * sizeof(d->policy[0]));
+	if (!d)
+		return NULL;
+
+	d->fields = fields;
+	for (i = 0; i < n_fields; i++) {
+		d->policy[i].name = fields[i].name;
+		d->policy[i].type = fields[i].type;
+	}
+
+	d->cp = blobmsg_policy_compile(d->policy, n_fields);
+	if (!d->cp) {
+		free(d);
+		return NULL;
+	}
+
+	return d;
+}
+
+void blobmsg_decoder_free(struct blobmsg_decoder *d)
+{
+	blobmsg_policy_compiled_free(d->cp);
+	free(d);
+}
+
+static bool
+blobmsg_field_set_string(const struct blobmsg_field *f, void *ptr, const char *str)
+{
+	int len;
+
+	if (!f->size) {
+		*(const char **) ptr = str;
+		return true;
+	}
+
+	if (!str)
+		str = "";
+
+	len = strlen(str);
+	if (len >= f->size)
+		return false;
+
+	memcpy(ptr, str, len + 1);
+	return true;
+}
+
+static void
+blobmsg_field_set_default(const struct blobmsg_field *f, void *ptr)
+{
+	switch (f->type) {
+	case BLOBMSG_TYPE_INT8:
+		*(uint8_t *) ptr = f->def;
+		break;
+	case BLOBMSG_TYPE_INT16:
+		*(uint16_t *) ptr = f->def;
+		break;
+	case BLOBMSG_TYPE_INT32:
+		*(uint32_t *) ptr = f->def;
+		break;
+	case BLOBMSG_TYPE_INT64:
+		*(uint64_t *) ptr = f->def;
+		break;
+	case BLOBMSG_TYPE_DOUBLE:
+		*(double *) ptr = f->def_double;
+		break;
+	case BLOBMSG_TYPE_STRING:
+		/* a default that does not fit is cut off */
+		if (!blobmsg_field_set_string(f, ptr, f->def_string)) {
+			memcpy(ptr, f->def_string, f->size - 1);
+			((char *) ptr)[f->size - 1] = 0;
+		}
+		break;
+	default:
+		*(struct blob_attr **) ptr = NULL;
+		break;
+	}
+}
+
+static bool
+blobmsg_field_set(const struct blobmsg_field *f, void *ptr, struct blob_attr *attr)
+{
+	switch (f->type) {
+	case BLOBMSG_TYPE_INT8:
+		*(uint8_t *) ptr = blobmsg_get_u8(attr);
+		break;
+	case BLOBMSG_TYPE_INT16:
+		*(uint16_t *) ptr = blobmsg_get_u16(attr);
+		break;
+	case BLOBMSG_TYPE_INT32:
+		*(uint32_t *) ptr = blobmsg_get_u32(attr);
+		break;
+	case BLOBMSG_TYPE_INT64:
+		*(uint64_t *) ptr = blobmsg_get_u64(attr);
+		break;
+	case BLOBMSG_TYPE_DOUBLE:
+		*(double *) ptr = blobmsg_get_double(attr);
+		break;
+	case BLOBMSG_TYPE_STRING:
+		return blobmsg_field_set_string(f, ptr, blobmsg_get_string(attr));
+	default:
+		*(struct blob_attr **) ptr = attr;
+		break;
+	}
+
+	return true;
+}
+
+int blobmsg_decode(const struct blobmsg_decoder *d, void *dest, void *data, int len)
+{
+	const struct blobmsg_compiled_policy *cp = d->cp;
+	const struct blobmsg_field *f;
+	struct blob_attr *attr;
+	uint8_t *found;
+	int i, n = 0;
+
+	found = alloca(cp->policy_len);
+	memset(found, 0, cp->policy_len);
+	for (i = 0; i < cp->policy_len; i++)
+		blobmsg_field_set_default(&d->fields[i], dest + d->fields[i].offset);
+
+	__blob_for_each_attr(attr, data, len) {
+		i = blobmsg_policy_find(cp, attr);
+		if (i < -1)
+			return -1;
+
+		for (; i >= 0; i = cp->next[i]) {
+			f = &d->fields[i];
+			if (f->type != BLOBMSG_TYPE_UNSPEC && blob_id(attr) != f->type)
+				continue;
+
+			if (found[i])
+				continue;
+
+			if (!blobmsg_field_set(f, dest + f->offset, attr))
+				return -1;
+
+			found[i] = 1;
+			n++;
+		}
+	}
+
+	return n;
+}
 
 static struct blob_attr *
 blobmsg_new(struct blob_buf *buf, int type, const char *name, int payload_len, void **data)
@@ -269,7 +618,9 @@ blobmsg_realloc_string_buffer(struct blob_buf *buf, int maxlen)
 	if (required <= 0)
 		goto out;
 
-	blob_buf_grow(buf, required);
+	if (!blob_buf_grow(buf, required))
+		return NULL;
+
 	attr = blob_next(buf->head);
 
 out:
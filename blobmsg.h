@@ -17,6 +17,7 @@
 #define __BLOBMSG_H
 
 #include <stdarg.h>
+#include <stddef.h>
 #include "blob.h"
 
 #define BLOBMSG_ALIGN	2
@@ -31,6 +32,7 @@ enum blobmsg_type {
 	BLOBMSG_TYPE_INT32,
 	BLOBMSG_TYPE_INT16,
 	BLOBMSG_TYPE_INT8,
+	BLOBMSG_TYPE_DOUBLE,
 	__BLOBMSG_TYPE_LAST,
 	BLOBMSG_TYPE_LAST = __BLOBMSG_TYPE_LAST - 1,
 	BLOBMSG_TYPE_BOOL = BLOBMSG_TYPE_INT8,
@@ -95,6 +97,77 @@ int blobmsg_parse(const struct blobmsg_policy *policy, int policy_len,
 int blobmsg_parse_array(const struct blobmsg_policy *policy, int policy_len,
 			struct blob_attr **tb, void *data, int len);
 
+/*
+ * blobmsg_policy_compile: build a name lookup table for a policy, so that
+ * parsing does not need to compare every attribute against every entry.
+ * the policy array must remain valid while the compiled policy is in use.
+ * returns NULL on error.
+ */
+struct blobmsg_compiled_policy;
+struct blobmsg_compiled_policy *
+blobmsg_policy_compile(const struct blobmsg_policy *policy, int policy_len);
+void blobmsg_policy_compiled_free(struct blobmsg_compiled_policy *cp);
+
+/*
+ * blobmsg_parse_compiled: same as blobmsg_parse, using a compiled policy.
+ * attributes too short for a blobmsg header are always rejected, instead of
+ * reading the header from past the attribute.
+ */
+int blobmsg_parse_compiled(const struct blobmsg_compiled_policy *cp,
+			   struct blob_attr **tb, void *data, int len);
+
+/*
+ * struct blobmsg_field: describes a member of a C struct filled in by
+ * blobmsg_decode. the member type depends on the field type:
+ *
+ * BLOBMSG_TYPE_INT8 (BOOL):	uint8_t
+ * BLOBMSG_TYPE_INT16:		uint16_t
+ * BLOBMSG_TYPE_INT32:		uint32_t
+ * BLOBMSG_TYPE_INT64:		uint64_t
+ * BLOBMSG_TYPE_DOUBLE:		double
+ * BLOBMSG_TYPE_STRING:		char[size], or const char * pointing into the
+ *				message if size is 0
+ * others:			struct blob_attr *
+ *
+ * fields missing from the message are set to def (integers), def_double
+ * or def_string.
+ */
+struct blobmsg_field {
+	const char *name;
+	enum blobmsg_type type;
+	unsigned int offset;
+	unsigned int size;
+	uint64_t def;
+	double def_double;
+	const char *def_string;
+};
+
+#define BLOBMSG_FIELD(_struct, _member, _name, _type)		\
+	.name = _name, .type = _type,				\
+	.offset = offsetof(_struct, _member)
+
+#define BLOBMSG_FIELD_STRBUF(_struct, _member, _name)		\
+	BLOBMSG_FIELD(_struct, _member, _name, BLOBMSG_TYPE_STRING),	\
+	.size = sizeof(((_struct *) 0)->_member)
+
+/*
+ * blobmsg_decoder_new: compile a field list for blobmsg_decode.
+ * the field array must remain valid while the decoder is in use.
+ */
+struct blobmsg_decoder;
+struct blobmsg_decoder *
+blobmsg_decoder_new(const struct blobmsg_field *fields, int n_fields);
+void blobmsg_decoder_free(struct blobmsg_decoder *d);
+
+/*
+ * blobmsg_decode: fill the struct at dest from the attributes of a table,
+ * in a single pass over the message. attributes are validated the same way
+ * as in blobmsg_parse_compiled.
+ * returns the number of fields found in the message, or -1 if an attribute
+ * is invalid or a string does not fit into its buffer.
+ */
+int blobmsg_decode(const struct blobmsg_decoder *d, void *dest, void *data, int len);
+
 int blobmsg_add_field(struct blob_buf *buf, int type, const char *name,
                       const void *data, int len);
 
@@ -125,6 +198,19 @@ blobmsg_add_u64(struct blob_buf *buf, const char *name, uint64_t val)
 	return blobmsg_add_field(buf, BLOBMSG_TYPE_INT64, name, &val, 8);
 }
 
+static inline int
+blobmsg_add_double(struct blob_buf *buf, const char *name, double val)
+{
+	union {
+		double d;
+		uint64_t u64;
+	} v;
+
+	v.d = val;
+	v.u64 = cpu_to_be64(v.u64);
+	return blobmsg_add_field(buf, BLOBMSG_TYPE_DOUBLE, name, &v.u64, 8);
+}
+
 static inline int
 blobmsg_add_string(struct blob_buf *buf, const char *name, const char *string)
 {
@@ -197,6 +283,17 @@ static inline uint64_t blobmsg_get_u64(struct blob_attr *attr)
 	return tmp;
 }
 
+static inline double blobmsg_get_double(struct blob_attr *attr)
+{
+	union {
+		double d;
+		uint64_t u64;
+	} v;
+
+	v.u64 = blobmsg_get_u64(attr);
+	return v.d;
+}
+
 static inline char *blobmsg_get_string(struct blob_attr *attr)
 {
 	return blobmsg_data(attr);
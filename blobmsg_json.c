@@ -13,8 +13,12 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <math.h>
+
 #include "blobmsg.h"
 #include "blobmsg_json.h"
+#include "blobmsg_json_parse.h"
+#include "ustream.h"
 
 bool blobmsg_add_object(struct blob_buf *b, json_object *obj)
 {
@@ -40,6 +44,7 @@ static bool blobmsg_add_array(struct blob_buf *b, struct array_list *a)
 bool blobmsg_add_json_element(struct blob_buf *b, const char *name, json_object *obj)
 {
 	bool ret = true;
+	int64_t val;
 	void *c;
 
 	if (!obj)
@@ -63,7 +68,14 @@ bool blobmsg_add_json_element(struct blob_buf *b, const char *name, json_object
 		blobmsg_add_u8(b, name, json_object_get_boolean(obj));
 		break;
 	case json_type_int:
-		blobmsg_add_u32(b, name, json_object_get_int(obj));
+		val = json_object_get_int64(obj);
+		if (val >= INT32_MIN && val <= INT32_MAX)
+			blobmsg_add_u32(b, name, (uint32_t) val);
+		else
+			blobmsg_add_u64(b, name, (uint64_t) val);
+		break;
+	case json_type_double:
+		blobmsg_add_double(b, name, json_object_get_double(obj));
 		break;
 	default:
 		return false;
@@ -99,6 +111,9 @@ bool blobmsg_add_json_from_string(struct blob_buf *b, const char *str)
 }
 
 
+#define ONES		0x0101010101010101ULL
+#define HIGHS		0x8080808080808080ULL
+
 struct strbuf {
 	int len;
 	int pos;
@@ -110,18 +125,46 @@ struct strbuf {
 	int indent_level;
 };
 
+/* make room for len more bytes, the buffer grows geometrically */
+static char *blobmsg_reserve(struct strbuf *s, int len)
+{
+	char *buf;
+	int new_len;
+
+	if (!s->buf)
+		return NULL;
+
+	if (s->pos + len >= s->len) {
+		new_len = s->len * 2;
+		if (new_len <= s->pos + len)
+			new_len = s->pos + len + 16;
+
+		buf = realloc(s->buf, new_len);
+		if (!buf) {
+			free(s->buf);
+			s->buf = NULL;
+			return NULL;
+		}
+
+		s->buf = buf;
+		s->len = new_len;
+	}
+
+	return s->buf + s->pos;
+}
+
 static bool blobmsg_puts(struct strbuf *s, const char *c, int len)
 {
+	char *dest;
+
 	if (len <= 0)
 		return true;
 
-	if (s->pos + len >= s->len) {
-		s->len += 16 + len;
-		s->buf = realloc(s->buf, s->len);
-		if (!s->buf)
-			return false;
-	}
-	memcpy(s->buf + s->pos, c, len);
+	dest = blobmsg_reserve(s, len);
+	if (!dest)
+		return false;
+
+	memcpy(dest, c, len);
 	s->pos += len;
 	return true;
 }
@@ -145,52 +188,114 @@ static void add_separator(struct strbuf *s)
 	*start = '\t';
 }
 
+static void blobmsg_format_int(struct strbuf *s, int64_t val)
+{
+	static const char digits[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+	uint64_t v = val < 0 ? -(uint64_t) val : val;
+	char buf[24], *p = buf + sizeof(buf);
+	int i;
+
+	while (v >= 100) {
+		i = (v % 100) * 2;
+		v /= 100;
+		*(--p) = digits[i + 1];
+		*(--p) = digits[i];
+	}
 
-static void blobmsg_format_string(struct strbuf *s, const char *str)
+	if (v >= 10) {
+		*(--p) = digits[v * 2 + 1];
+		*(--p) = digits[v * 2];
+	} else {
+		*(--p) = '0' + v;
+	}
+
+	if (val < 0)
+		*(--p) = '-';
+
+	blobmsg_puts(s, p, buf + sizeof(buf) - p);
+}
+
+static void blobmsg_format_double(struct strbuf *s, double val)
 {
-	const unsigned char *p, *last, *end;
-	char buf[8] = "\\u00";
+	char buf[BLOBMSG_JSON_DOUBLE_LEN + 2];
+	int len;
 
-	end = (unsigned char *) str + strlen(str);
-	blobmsg_puts(s, "\"", 1);
-	for (p = (unsigned char *) str, last = p; *p; p++) {
-		char escape = '\0';
-		int len;
+	/* not representable in JSON */
+	if (!isfinite(val)) {
+		blobmsg_puts(s, "null", 4);
+		return;
+	}
 
-		switch(*p) {
-		case '\b':
-			escape = 'b';
-			break;
-		case '\n':
-			escape = 'n';
-			break;
-		case '\t':
-			escape = 't';
-			break;
-		case '\r':
-			escape = 'r';
-			break;
-		case '"':
-		case '\\':
-		case '/':
-			escape = *p;
-			break;
-		default:
-			if (*p < ' ')
-				escape = 'u';
+	len = blobmsg_json_format_double(buf, val);
+
+	/* keep it a floating point value when parsed again */
+	if (strspn(buf, "-0123456789") == len) {
+		memcpy(buf + len, ".0", 3);
+		len += 2;
+	}
+
+	blobmsg_puts(s, buf, len);
+}
+
+static const char json_escape[256] = {
+	[0 ... 0x1f] = 'u',
+	['\b'] = 'b',
+	['\n'] = 'n',
+	['\t'] = 't',
+	['\r'] = 'r',
+	['"'] = '"',
+	['\\'] = '\\',
+	['/'] = '/',
+};
+
+/* find the next character that needs to be escaped, a word at a time */
+static const char *blobmsg_scan_escape(const char *p, const char *end)
+{
+	uint64_t v, t;
+
+	while (end - p >= sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		t = ((v ^ (ONES * '"')) - ONES) & ~(v ^ (ONES * '"'));
+		t |= ((v ^ (ONES * '\\')) - ONES) & ~(v ^ (ONES * '\\'));
+		t |= ((v ^ (ONES * '/')) - ONES) & ~(v ^ (ONES * '/'));
+		t |= (v - ONES * 0x20) & ~v;
+		if (t & HIGHS)
 			break;
-		}
 
-		if (!escape)
-			continue;
+		p += sizeof(v);
+	}
+
+	while (p < end && !json_escape[(unsigned char) *p])
+		p++;
+
+	return p;
+}
+
+static void blobmsg_format_string(struct strbuf *s, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *p, *end;
+	char buf[8] = "\\u00";
+	unsigned char c;
+	int len;
 
-		if (p > last)
-			blobmsg_puts(s, (char *) last, p - last);
-		last = p + 1;
-		buf[1] = escape;
+	end = str + strlen(str);
+	blobmsg_puts(s, "\"", 1);
+	for (p = str; p < end; p++) {
+		str = p;
+		p = blobmsg_scan_escape(p, end);
+		blobmsg_puts(s, str, p - str);
+		if (p == end)
+			break;
 
-		if (escape == 'u') {
-			sprintf(buf + 4, "%02x", (unsigned char) *p);
+		c = *p;
+		buf[1] = json_escape[c];
+		if (buf[1] == 'u') {
+			buf[4] = hex[c >> 4];
+			buf[5] = hex[c & 0xf];
 			len = 6;
 		} else {
 			len = 2;
@@ -198,66 +303,81 @@ static void blobmsg_format_string(struct strbuf *s, const char *str)
 		blobmsg_puts(s, buf, len);
 	}
 
-	blobmsg_puts(s, (char *) last, end - last);
 	blobmsg_puts(s, "\"", 1);
 }
 
 static void blobmsg_format_json_list(struct strbuf *s, struct blob_attr *attr, int len, bool array);
 
-static void blobmsg_format_element(struct strbuf *s, struct blob_attr *attr, bool array, bool head)
+/*
+ * format the name of an element, and its value if the custom formatter
+ * handles it. returns true if the value has been formatted.
+ */
+static bool blobmsg_format_head(struct strbuf *s, struct blob_attr *attr, bool array, bool head)
 {
 	const char *data_str;
-	char buf[32];
+
+	if (!array && blobmsg_name(attr)[0]) {
+		blobmsg_format_string(s, blobmsg_name(attr));
+		blobmsg_puts(s, ": ", s->indent ? 2 : 1);
+	}
+
+	if (head || !s->custom_format)
+		return false;
+
+	data_str = s->custom_format(s->priv, attr);
+	if (!data_str)
+		return false;
+
+	blobmsg_puts(s, data_str, strlen(data_str));
+	return true;
+}
+
+static void blobmsg_format_element(struct strbuf *s, struct blob_attr *attr, bool array, bool head)
+{
 	void *data;
 	int len;
 
 	if (!blobmsg_check_attr(attr, false))
 		return;
 
-	if (!array && blobmsg_name(attr)[0]) {
-		blobmsg_format_string(s, blobmsg_name(attr));
-		blobmsg_puts(s, ": ", s->indent ? 2 : 1);
-	}
+	if (blobmsg_format_head(s, attr, array, head))
+		return;
 
 	data = blobmsg_data(attr);
 	len = blobmsg_data_len(attr);
 
-	if (!head && s->custom_format) {
-		data_str = s->custom_format(s->priv, attr);
-		if (data_str)
-			goto out;
-	}
-
-	data_str = buf;
 	switch(blob_id(attr)) {
 	case BLOBMSG_TYPE_UNSPEC:
-		sprintf(buf, "null");
+		blobmsg_puts(s, "null", 4);
 		break;
 	case BLOBMSG_TYPE_BOOL:
-		sprintf(buf, "%s", *(uint8_t *)data ? "true" : "false");
+		if (*(uint8_t *)data)
+			blobmsg_puts(s, "true", 4);
+		else
+			blobmsg_puts(s, "false", 5);
 		break;
 	case BLOBMSG_TYPE_INT16:
-		sprintf(buf, "%d", be16_to_cpu(*(uint16_t *)data));
+		blobmsg_format_int(s, blobmsg_get_u16(attr));
 		break;
 	case BLOBMSG_TYPE_INT32:
-		sprintf(buf, "%d", (int32_t) be32_to_cpu(*(uint32_t *)data));
+		blobmsg_format_int(s, (int32_t) blobmsg_get_u32(attr));
 		break;
 	case BLOBMSG_TYPE_INT64:
-		sprintf(buf, "%lld", (long long int) be64_to_cpu(*(uint64_t *)data));
+		blobmsg_format_int(s, (int64_t) blobmsg_get_u64(attr));
+		break;
+	case BLOBMSG_TYPE_DOUBLE:
+		blobmsg_format_double(s, blobmsg_get_double(attr));
 		break;
 	case BLOBMSG_TYPE_STRING:
 		blobmsg_format_string(s, data);
-		return;
+		break;
 	case BLOBMSG_TYPE_ARRAY:
 		blobmsg_format_json_list(s, data, len, true);
-		return;
+		break;
 	case BLOBMSG_TYPE_TABLE:
 		blobmsg_format_json_list(s, data, len, false);
-		return;
+		break;
 	}
-
-out:
-	blobmsg_puts(s, data_str, strlen(data_str));
 }
 
 static void blobmsg_format_json_list(struct strbuf *s, struct blob_attr *attr, int len, bool array)
@@ -286,6 +406,7 @@ static void blobmsg_format_json_list(struct strbuf *s, struct blob_attr *attr, i
 char *blobmsg_format_json_with_cb(struct blob_attr *attr, bool list, blobmsg_json_format_t cb, void *priv, int indent)
 {
 	struct strbuf s;
+	char *buf;
 
 	s.len = blob_len(attr);
 	s.buf = malloc(s.len);
@@ -304,11 +425,193 @@ char *blobmsg_format_json_with_cb(struct blob_attr *attr, bool list, blobmsg_jso
 	else
 		blobmsg_format_element(&s, attr, false, false);
 
-	if (!s.len)
+	if (!blobmsg_reserve(&s, 1))
 		return NULL;
 
-	s.buf = realloc(s.buf, s.pos + 1);
 	s.buf[s.pos] = 0;
+	buf = realloc(s.buf, s.pos + 1);
+
+	return buf ? buf : s.buf;
+}
+
+#define BLOBMSG_JSON_CHUNK	4096
+#define BLOBMSG_JSON_PENDING	65536
+
+struct blobmsg_json_level {
+	struct blob_attr *pos;
+	int rem;
+	bool array;
+	bool first;
+};
+
+struct blobmsg_json_writer {
+	struct ustream *stream;
+	struct strbuf s;
+
+	/* tables and arrays that have been opened, but not closed yet */
+	struct blobmsg_json_level *stack;
+	int depth, stack_size;
+};
+
+static bool blobmsg_json_writer_open(struct blobmsg_json_writer *w, struct blob_attr *attr, bool array)
+{
+	struct blobmsg_json_level *l;
+	int size;
 
-	return s.buf;
+	if (w->depth == w->stack_size) {
+		size = w->stack_size ? w->stack_size * 2 : 8;
+		l = realloc(w->stack, size * sizeof(*l));
+		if (!l)
+			return false;
+
+		w->stack = l;
+		w->stack_size = size;
+	}
+
+	l = &w->stack[w->depth++];
+	l->pos = blobmsg_data(attr);
+	l->rem = blobmsg_data_len(attr);
+	l->array = array;
+	l->first = true;
+
+	blobmsg_puts(&w->s, (array ? "[" : "{" ), 1);
+	w->s.indent_level++;
+	add_separator(&w->s);
+	return true;
+}
+
+static bool blobmsg_json_writer_element(struct blobmsg_json_writer *w, struct blob_attr *attr, bool array)
+{
+	if (!blobmsg_check_attr(attr, false))
+		return true;
+
+	switch (blob_id(attr)) {
+	case BLOBMSG_TYPE_ARRAY:
+	case BLOBMSG_TYPE_TABLE:
+		if (blobmsg_format_head(&w->s, attr, array, false))
+			return true;
+
+		return blobmsg_json_writer_open(w, attr, blob_id(attr) == BLOBMSG_TYPE_ARRAY);
+	default:
+		blobmsg_format_element(&w->s, attr, array, false);
+		return true;
+	}
+}
+
+/* format the next element of the innermost table or array, or close it */
+static bool blobmsg_json_writer_step(struct blobmsg_json_writer *w)
+{
+	struct blobmsg_json_level *l = &w->stack[w->depth - 1];
+	struct blob_attr *attr = l->pos;
+
+	if (l->rem <= 0 || blob_pad_len(attr) > l->rem ||
+	    blob_pad_len(attr) < sizeof(struct blob_attr)) {
+		w->s.indent_level--;
+		add_separator(&w->s);
+		blobmsg_puts(&w->s, (l->array ? "]" : "}"), 1);
+		w->depth--;
+		return true;
+	}
+
+	l->rem -= blob_pad_len(attr);
+	l->pos = blob_next(attr);
+	if (!l->first) {
+		blobmsg_puts(&w->s, ",", 1);
+		add_separator(&w->s);
+	}
+	l->first = false;
+
+	return blobmsg_json_writer_element(w, attr, l->array);
+}
+
+/* returns the number of bytes the stream did not take, -1 on error */
+static int blobmsg_json_writer_flush(struct blobmsg_json_writer *w)
+{
+	struct strbuf *s = &w->s;
+	int len;
+
+	if (!s->pos)
+		return 0;
+
+	len = ustream_write(w->stream, s->buf, s->pos, w->depth > 0);
+	if (len < 0 || w->stream->write_error)
+		return -1;
+
+	s->pos -= len;
+	if (s->pos)
+		memmove(s->buf, s->buf + len, s->pos);
+
+	return s->pos;
+}
+
+int blobmsg_json_writer_run(struct blobmsg_json_writer *w)
+{
+	int ret;
+
+	while (1) {
+		if (!w->s.buf)
+			return -1;
+
+		if (w->s.pos >= BLOBMSG_JSON_CHUNK || !w->depth) {
+			ret = blobmsg_json_writer_flush(w);
+			if (ret < 0)
+				return -1;
+
+			/* the write queue is full */
+			if (ret > 0)
+				return 0;
+
+			if (!w->depth)
+				return 1;
+		}
+
+		if (w->stream->w.data_bytes >= BLOBMSG_JSON_PENDING)
+			return 0;
+
+		if (!blobmsg_json_writer_step(w))
+			return -1;
+	}
+}
+
+struct blobmsg_json_writer *
+blobmsg_json_writer_new(struct ustream *us, struct blob_attr *attr, bool list,
+			blobmsg_json_format_t cb, void *priv, int indent)
+{
+	struct blobmsg_json_writer *w;
+	struct strbuf *s;
+	bool ret;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	s = &w->s;
+	s->len = 2 * BLOBMSG_JSON_CHUNK;
+	s->buf = malloc(s->len);
+	s->custom_format = cb;
+	s->priv = priv;
+	if (indent >= 0) {
+		s->indent = true;
+		s->indent_level = indent;
+	}
+
+	w->stream = us;
+	if (list)
+		ret = blobmsg_json_writer_open(w, attr, false);
+	else
+		ret = blobmsg_json_writer_element(w, attr, false);
+
+	if (!ret || !s->buf) {
+		blobmsg_json_writer_free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+void blobmsg_json_writer_free(struct blobmsg_json_writer *w)
+{
+	free(w->s.buf);
+	free(w->stack);
+	free(w);
 }
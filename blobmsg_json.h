@@ -46,4 +46,29 @@ static inline char *blobmsg_format_json_indent(struct blob_attr *attr, bool list
 	return blobmsg_format_json_with_cb(attr, list, NULL, NULL, indent);
 }
 
+struct ustream;
+struct blobmsg_json_writer;
+
+/*
+ * blobmsg_json_writer_new: format JSON into the write queue of a stream
+ *
+ * takes the same arguments as blobmsg_format_json_with_cb. the output is
+ * passed to the stream in small chunks instead of being built in memory
+ * as a whole. attr must remain valid until the writer is freed.
+ */
+struct blobmsg_json_writer *
+blobmsg_json_writer_new(struct ustream *s, struct blob_attr *attr, bool list,
+			blobmsg_json_format_t cb, void *priv, int indent);
+
+/*
+ * blobmsg_json_writer_run: format and queue more data
+ *
+ * stops once 64k of data is pending in the write queue (or the stream
+ * does not accept more), call it again from the notify_write callback.
+ * returns 1 when everything has been queued, 0 if there is more to write,
+ * or -1 on error
+ */
+int blobmsg_json_writer_run(struct blobmsg_json_writer *w);
+void blobmsg_json_writer_free(struct blobmsg_json_writer *w);
+
 #endif
@@ -0,0 +1,706 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <locale.h>
+#include <math.h>
+
+#include "blobmsg_json_parse.h"
+
+#define ONES		0x0101010101010101ULL
+#define HIGHS		0x8080808080808080ULL
+
+enum {
+	JSON_START,
+	JSON_KEY_OR_CLOSE,
+	JSON_KEY,
+	JSON_KEY_STRING,
+	JSON_COLON,
+	JSON_VALUE_OR_CLOSE,
+	JSON_VALUE,
+	JSON_STRING,
+	JSON_NUMBER,
+	JSON_LITERAL,
+	JSON_NEXT,
+	JSON_DONE,
+	JSON_ERROR,
+};
+
+static bool json_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* find the next '"', '\\' or control character, a word at a time */
+static const char *json_scan_string(const char *s, const char *end)
+{
+	uint64_t v, t;
+
+	while (end - s >= sizeof(v)) {
+		memcpy(&v, s, sizeof(v));
+		t = ((v ^ (ONES * '"')) - ONES) & ~(v ^ (ONES * '"'));
+		t |= ((v ^ (ONES * '\\')) - ONES) & ~(v ^ (ONES * '\\'));
+		t |= (v - ONES * 0x20) & ~v;
+		if (t & HIGHS)
+			break;
+
+		s += sizeof(v);
+	}
+
+	while (s < end && *s != '"' && *s != '\\' && (uint8_t) *s >= 0x20)
+		s++;
+
+	return s;
+}
+
+static int json_hex4(const char *s)
+{
+	int i, val = 0;
+
+	for (i = 0; i < 4; i++) {
+		val <<= 4;
+		if (s[i] >= '0' && s[i] <= '9')
+			val |= s[i] - '0';
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			val |= s[i] - 'a' + 10;
+		else if (s[i] >= 'A' && s[i] <= 'F')
+			val |= s[i] - 'A' + 10;
+		else
+			return -1;
+	}
+
+	return val;
+}
+
+static int json_put_utf8(char *d, unsigned int c)
+{
+	if (c < 0x80) {
+		d[0] = c;
+		return 1;
+	}
+
+	if (c < 0x800) {
+		d[0] = 0xc0 | (c >> 6);
+		d[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+
+	if (c < 0x10000) {
+		d[0] = 0xe0 | (c >> 12);
+		d[1] = 0x80 | ((c >> 6) & 0x3f);
+		d[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+
+	d[0] = 0xf0 | (c >> 18);
+	d[1] = 0x80 | ((c >> 12) & 0x3f);
+	d[2] = 0x80 | ((c >> 6) & 0x3f);
+	d[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+/*
+ * copy a string from the input to dest, resolving escape sequences.
+ * the result is never longer than the input, dest needs len + 1 bytes.
+ */
+static int json_unescape(char *dest, const char *s, int len)
+{
+	const char *end = s + len, *e;
+	char *d = dest;
+	int c, lo;
+
+	while (s < end) {
+		e = memchr(s, '\\', end - s);
+		if (!e)
+			e = end;
+
+		memcpy(d, s, e - s);
+		d += e - s;
+		s = e;
+		if (s == end)
+			break;
+
+		s++;
+		switch (*(s++)) {
+		case '"':
+		case '\\':
+		case '/':
+			*(d++) = s[-1];
+			break;
+		case 'b':
+			*(d++) = '\b';
+			break;
+		case 'f':
+			*(d++) = '\f';
+			break;
+		case 'n':
+			*(d++) = '\n';
+			break;
+		case 'r':
+			*(d++) = '\r';
+			break;
+		case 't':
+			*(d++) = '\t';
+			break;
+		case 'u':
+			if (end - s < 4 || (c = json_hex4(s)) <= 0)
+				return -1;
+
+			s += 4;
+			if (c >= 0xdc00 && c <= 0xdfff)
+				return -1;
+
+			if (c >= 0xd800 && c <= 0xdbff) {
+				if (end - s < 6 || s[0] != '\\' || s[1] != 'u')
+					return -1;
+
+				lo = json_hex4(s + 2);
+				if (lo < 0xdc00 || lo > 0xdfff)
+					return -1;
+
+				s += 6;
+				c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+			}
+
+			d += json_put_utf8(d, c);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	*d = 0;
+	return d - dest;
+}
+
+/* name for the next value: the current key inside of an object */
+static const char *json_name(struct blobmsg_json_parser *p)
+{
+	return p->array[p->depth - 1] ? NULL : p->key;
+}
+
+static bool json_append(struct blobmsg_json_parser *p, const char *data, int len)
+{
+	char *buf;
+	int size;
+
+	if (p->state == JSON_KEY_STRING) {
+		if (p->key_len + len >= p->key_size) {
+			size = p->key_len + len + 64;
+			buf = realloc(p->key, size);
+			if (!buf)
+				return false;
+
+			p->key = buf;
+			p->key_size = size;
+		}
+
+		memcpy(p->key + p->key_len, data, len);
+		p->key_len += len;
+		return true;
+	}
+
+	/* strings are unescaped in place in the blob buffer */
+	if (p->str_len + len >= p->str_size) {
+		size = p->str_size * 2;
+		if (size <= p->str_len + len)
+			size = p->str_len + len + 1;
+
+		buf = blobmsg_realloc_string_buffer(p->b, size);
+		if (!buf)
+			return false;
+
+		p->str = buf;
+		p->str_size = size;
+	}
+
+	memcpy(p->str + p->str_len, data, len);
+	p->str_len += len;
+	return true;
+}
+
+static bool json_string_begin(struct blobmsg_json_parser *p, const char *s, const char *end)
+{
+	p->esc_len = 0;
+	if (p->state == JSON_KEY_STRING) {
+		p->key_len = 0;
+		return json_append(p, "", 0);
+	}
+
+	/* size the buffer for the part of the string that is already here */
+	p->str_len = 0;
+	p->str_size = json_scan_string(s, end) - s + 16;
+	p->str = blobmsg_alloc_string_buffer(p->b, json_name(p), p->str_size);
+
+	return !!p->str;
+}
+
+static bool json_string_end(struct blobmsg_json_parser *p)
+{
+	if (p->state == JSON_KEY_STRING) {
+		/* does not fit into struct blobmsg_hdr */
+		if (p->key_len > UINT16_MAX)
+			return false;
+
+		p->key[p->key_len] = 0;
+		p->state = JSON_COLON;
+		return true;
+	}
+
+	p->str[p->str_len] = 0;
+	blobmsg_add_string_buffer(p->b);
+	p->state = JSON_NEXT;
+	return true;
+}
+
+/* length of the escape sequence in p->esc, as far as it is known yet */
+static int json_escape_len(struct blobmsg_json_parser *p)
+{
+	int c;
+
+	if (p->esc[1] != 'u')
+		return 2;
+
+	if (p->esc_len < 6)
+		return 6;
+
+	/* a high surrogate needs to be followed by a low one */
+	c = json_hex4(p->esc + 2);
+	if (c >= 0xd800 && c <= 0xdbff)
+		return 12;
+
+	return 6;
+}
+
+static int json_string_data(struct blobmsg_json_parser *p, const char *s, const char *end)
+{
+	const char *start = s, *e;
+	char buf[8];
+	int len;
+
+	while (s < end) {
+		if (p->esc_len) {
+			p->esc[p->esc_len++] = *(s++);
+			if ((p->esc_len == 7 && p->esc[6] != '\\') ||
+			    (p->esc_len == 8 && p->esc[7] != 'u'))
+				return -1;
+
+			if (p->esc_len < json_escape_len(p))
+				continue;
+
+			len = json_unescape(buf, p->esc, p->esc_len);
+			p->esc_len = 0;
+			if (len < 0 || !json_append(p, buf, len))
+				return -1;
+
+			continue;
+		}
+
+		e = json_scan_string(s, end);
+		if (e > s && !json_append(p, s, e - s))
+			return -1;
+
+		s = e;
+		if (s == end)
+			break;
+
+		if (*s == '"') {
+			if (!json_string_end(p))
+				return -1;
+
+			return s + 1 - start;
+		}
+
+		/* control character */
+		if (*s != '\\')
+			return -1;
+
+		p->esc[p->esc_len++] = *(s++);
+	}
+
+	return s - start;
+}
+
+static bool json_is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/*
+ * strtod and printf use the radix character of the current locale, which
+ * is not necessarily '.'
+ */
+double blobmsg_json_strtod(const char *str)
+{
+	const char *radix = localeconv()->decimal_point;
+	const char *dot = strchr(str, '.');
+	int len, radix_len;
+	char *buf;
+	double val;
+
+	if (!dot || !strcmp(radix, "."))
+		return strtod(str, NULL);
+
+	len = dot - str;
+	radix_len = strlen(radix);
+	buf = malloc(strlen(str) + radix_len);
+	if (!buf)
+		return NAN;
+
+	memcpy(buf, str, len);
+	memcpy(buf + len, radix, radix_len);
+	strcpy(buf + len + radix_len, dot + 1);
+	val = strtod(buf, NULL);
+	free(buf);
+
+	return val;
+}
+
+int blobmsg_json_format_double(char *buf, double val)
+{
+	const char *radix = localeconv()->decimal_point;
+	int prec, radix_len;
+	char *dot;
+
+	for (prec = 15; prec < 17; prec++) {
+		snprintf(buf, BLOBMSG_JSON_DOUBLE_LEN, "%.*g", prec, val);
+		if (strtod(buf, NULL) == val)
+			break;
+	}
+	if (prec == 17)
+		snprintf(buf, BLOBMSG_JSON_DOUBLE_LEN, "%.17g", val);
+
+	radix_len = strlen(radix);
+	dot = radix_len ? strstr(buf, radix) : NULL;
+	if (dot && strcmp(radix, ".") != 0) {
+		*dot = '.';
+		memmove(dot + 1, dot + radix_len, strlen(dot + radix_len) + 1);
+	}
+
+	return strlen(buf);
+}
+
+static bool json_add_number(struct blobmsg_json_parser *p)
+{
+	const char *s = p->num, *end = p->num + p->num_len;
+	bool neg = false, is_int = true;
+	uint64_t num = 0;
+	double val;
+	int d;
+
+	if (*s == '-') {
+		neg = true;
+		s++;
+	}
+
+	/* no leading zeros */
+	if (s == end || !json_is_digit(*s) ||
+	    (*s == '0' && s + 1 < end && json_is_digit(s[1])))
+		return false;
+
+	for (; s < end && json_is_digit(*s); s++) {
+		d = *s - '0';
+		if (num > (UINT64_MAX - d) / 10)
+			is_int = false;
+		else
+			num = num * 10 + d;
+	}
+
+	if (s < end && *s == '.') {
+		is_int = false;
+		if (++s == end || !json_is_digit(*s))
+			return false;
+
+		while (s < end && json_is_digit(*s))
+			s++;
+	}
+
+	if (s < end && (*s == 'e' || *s == 'E')) {
+		is_int = false;
+		if (++s < end && (*s == '+' || *s == '-'))
+			s++;
+
+		if (s == end || !json_is_digit(*s))
+			return false;
+
+		while (s < end && json_is_digit(*s))
+			s++;
+	}
+
+	if (s != end)
+		return false;
+
+	if (is_int && num <= (uint64_t) INT64_MAX + neg) {
+		num = neg ? -num : num;
+		if ((int64_t) num >= INT32_MIN && (int64_t) num <= INT32_MAX)
+			return blobmsg_add_u32(p->b, json_name(p), (uint32_t) num) >= 0;
+
+		return blobmsg_add_u64(p->b, json_name(p), num) >= 0;
+	}
+
+	p->num[p->num_len] = 0;
+	val = blobmsg_json_strtod(p->num);
+	if (isinf(val))
+		return false;
+
+	return blobmsg_add_double(p->b, json_name(p), val) >= 0;
+}
+
+static int json_number_data(struct blobmsg_json_parser *p, const char *s, const char *end)
+{
+	const char *start = s;
+
+	/* collect the number, json_add_number checks the syntax */
+	for (; s < end; s++) {
+		if (!json_is_digit(*s) && *s != '-' && *s != '+' &&
+		    *s != '.' && *s != 'e' && *s != 'E')
+			break;
+
+		if (p->num_len >= sizeof(p->num) - 1)
+			return -1;
+
+		p->num[p->num_len++] = *s;
+	}
+
+	/* more of it may follow in the next chunk */
+	if (s == end)
+		return s - start;
+
+	if (!json_add_number(p))
+		return -1;
+
+	p->state = JSON_NEXT;
+	return s - start;
+}
+
+static int json_literal_data(struct blobmsg_json_parser *p, const char *s, const char *end)
+{
+	const char *start = s;
+	const char *name = json_name(p);
+	int ret;
+
+	for (; s < end && p->literal[p->literal_pos]; s++, p->literal_pos++) {
+		if (*s != p->literal[p->literal_pos])
+			return -1;
+	}
+
+	if (p->literal[p->literal_pos])
+		return s - start;
+
+	switch (p->literal[0]) {
+	case 't':
+		ret = blobmsg_add_u8(p->b, name, true);
+		break;
+	case 'f':
+		ret = blobmsg_add_u8(p->b, name, false);
+		break;
+	default:
+		ret = blobmsg_add_field(p->b, BLOBMSG_TYPE_UNSPEC, name, NULL, 0);
+		break;
+	}
+
+	if (ret < 0)
+		return -1;
+
+	p->state = JSON_NEXT;
+	return s - start;
+}
+
+static bool json_open(struct blobmsg_json_parser *p, bool array)
+{
+	if (p->depth >= BLOBMSG_JSON_MAX_DEPTH)
+		return false;
+
+	/* members of the outermost object are added to the buffer directly */
+	if (p->depth)
+		p->cookie[p->depth] = blobmsg_open_nested(p->b, json_name(p), array);
+
+	p->array[p->depth++] = array;
+	p->state = array ? JSON_VALUE_OR_CLOSE : JSON_KEY_OR_CLOSE;
+	return true;
+}
+
+static bool json_close(struct blobmsg_json_parser *p, char c)
+{
+	if (c != (p->array[p->depth - 1] ? ']' : '}'))
+		return false;
+
+	if (--p->depth == 0) {
+		p->state = JSON_DONE;
+		p->done = true;
+		return true;
+	}
+
+	blob_nest_end(p->b, p->cookie[p->depth]);
+	p->state = JSON_NEXT;
+	return true;
+}
+
+static bool json_value_begin(struct blobmsg_json_parser *p, const char *s, const char *end)
+{
+	switch (*s) {
+	case '{':
+	case '[':
+		return json_open(p, *s == '[');
+	case '"':
+		p->state = JSON_STRING;
+		return json_string_begin(p, s + 1, end);
+	case 't':
+		p->literal = "true";
+		break;
+	case 'f':
+		p->literal = "false";
+		break;
+	case 'n':
+		p->literal = "null";
+		break;
+	default:
+		return false;
+	}
+
+	p->literal_pos = 1;
+	p->state = JSON_LITERAL;
+	return true;
+}
+
+int blobmsg_json_parser_feed(struct blobmsg_json_parser *p, const char *data, int len)
+{
+	const char *s = data, *end = data + len;
+	int n;
+
+	while (s < end) {
+		switch (p->state) {
+		case JSON_STRING:
+		case JSON_KEY_STRING:
+			n = json_string_data(p, s, end);
+			break;
+		case JSON_NUMBER:
+			n = json_number_data(p, s, end);
+			break;
+		case JSON_LITERAL:
+			n = json_literal_data(p, s, end);
+			break;
+		case JSON_DONE:
+			return s - data;
+		case JSON_ERROR:
+			return -1;
+		default:
+			n = 0;
+			break;
+		}
+
+		if (n < 0)
+			goto error;
+
+		if (n > 0) {
+			s += n;
+			continue;
+		}
+
+		if (json_is_space(*s)) {
+			s++;
+			continue;
+		}
+
+		switch (p->state) {
+		case JSON_START:
+			if (*s != '{' || !json_open(p, false))
+				goto error;
+			break;
+		case JSON_KEY_OR_CLOSE:
+			if (*s == '}') {
+				json_close(p, *s);
+				break;
+			}
+			/* fall through */
+		case JSON_KEY:
+			if (*s != '"')
+				goto error;
+
+			p->state = JSON_KEY_STRING;
+			if (!json_string_begin(p, s + 1, end))
+				goto error;
+			break;
+		case JSON_COLON:
+			if (*s != ':')
+				goto error;
+
+			p->state = JSON_VALUE;
+			break;
+		case JSON_VALUE_OR_CLOSE:
+			if (*s == ']') {
+				json_close(p, *s);
+				break;
+			}
+			/* fall through */
+		case JSON_VALUE:
+			if (*s == '-' || (*s >= '0' && *s <= '9')) {
+				p->num_len = 0;
+				p->state = JSON_NUMBER;
+				continue;
+			}
+
+			if (!json_value_begin(p, s, end))
+				goto error;
+			break;
+		case JSON_NEXT:
+			if (*s == ',')
+				p->state = p->array[p->depth - 1] ? JSON_VALUE : JSON_KEY;
+			else if (!json_close(p, *s))
+				goto error;
+			break;
+		default:
+			goto error;
+		}
+
+		s++;
+	}
+
+	return s - data;
+
+error:
+	p->state = JSON_ERROR;
+	return -1;
+}
+
+void blobmsg_json_parser_init(struct blobmsg_json_parser *p, struct blob_buf *b)
+{
+	memset(p, 0, sizeof(*p));
+	p->b = b;
+	p->state = JSON_START;
+}
+
+void blobmsg_json_parser_free(struct blobmsg_json_parser *p)
+{
+	free(p->key);
+	p->key = NULL;
+	p->key_size = 0;
+}
+
+bool blobmsg_add_json_buf(struct blob_buf *b, const char *str, int len)
+{
+	struct blobmsg_json_parser p;
+	int n;
+
+	blobmsg_json_parser_init(&p, b);
+	n = blobmsg_json_parser_feed(&p, str, len);
+	blobmsg_json_parser_free(&p);
+	if (n < 0 || !p.done)
+		return false;
+
+	while (n < len && json_is_space(str[n]))
+		n++;
+
+	return n == len;
+}
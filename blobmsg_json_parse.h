@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __BLOBMSG_JSON_PARSE_H
+#define __BLOBMSG_JSON_PARSE_H
+
+#include <stdbool.h>
+#include "blobmsg.h"
+
+#define BLOBMSG_JSON_MAX_DEPTH	32
+
+/*
+ * struct blobmsg_json_parser: state of a JSON object that is parsed as it
+ * arrives, one chunk at a time. attributes are added to the blob buffer
+ * as soon as they are complete, only the parser state is kept between
+ * chunks (no copy of the input).
+ */
+struct blobmsg_json_parser {
+	struct blob_buf *b;
+
+	/* set once the closing brace of the object has been parsed */
+	bool done;
+
+	/* private */
+	int state;
+	int depth;
+	bool array[BLOBMSG_JSON_MAX_DEPTH];
+	void *cookie[BLOBMSG_JSON_MAX_DEPTH];
+
+	char *key;
+	int key_len, key_size;
+
+	char *str;
+	int str_len, str_size;
+
+	char esc[12];
+	int esc_len;
+
+	const char *literal;
+	int literal_pos;
+
+	char num[64];
+	int num_len;
+};
+
+void blobmsg_json_parser_init(struct blobmsg_json_parser *p, struct blob_buf *b);
+void blobmsg_json_parser_free(struct blobmsg_json_parser *p);
+
+/*
+ * blobmsg_json_parser_feed: parse the next chunk of input
+ *
+ * returns the number of bytes used, which is less than len only once the
+ * object is done, or -1 on a syntax error (the blob buffer then contains
+ * a partial message).
+ */
+int blobmsg_json_parser_feed(struct blobmsg_json_parser *p, const char *data, int len);
+
+/*
+ * blobmsg_add_json_buf: parse a JSON object and add its members to the
+ * blob buffer, without building an intermediate json-c object tree.
+ * integers that do not fit into 32 bit are added as BLOBMSG_TYPE_INT64,
+ * numbers with a fraction or exponent and integers beyond 64 bit as
+ * BLOBMSG_TYPE_DOUBLE. numbers longer than 63 characters are rejected.
+ * the input does not need to be 0-terminated.
+ */
+bool blobmsg_add_json_buf(struct blob_buf *b, const char *str, int len);
+
+#define BLOBMSG_JSON_DOUBLE_LEN	32
+
+/*
+ * blobmsg_json_format_double: print val to buf (BLOBMSG_JSON_DOUBLE_LEN
+ * bytes) with the shortest precision that reads back as the same value.
+ * the radix character is always '.', regardless of the locale.
+ * returns the length of the string.
+ */
+int blobmsg_json_format_double(char *buf, double val);
+
+/* blobmsg_json_strtod: strtod for numbers that use '.' as radix character */
+double blobmsg_json_strtod(const char *str);
+
+#endif
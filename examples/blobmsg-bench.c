@@ -0,0 +1,121 @@
+/*
+ * blobmsg-bench.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Builds a blobmsg table with a large number of entries, growing the buffer
+ * in fixed steps (the old policy), geometrically, and after reserving the
+ * space with blob_buf_reserve.
+ *
+ * usage: blobmsg-bench [<entries> [<rounds>]]
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "blobmsg.h"
+
+static int entries = 100000;
+static int grows;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool linear_grow(struct blob_buf *buf, int minlen)
+{
+	int delta = ((minlen / 256) + 1) * 256;
+	void *new;
+
+	new = realloc(buf->buf, buf->buflen + delta);
+	if (!new)
+		return false;
+
+	memset(new + buf->buflen, 0, delta);
+	buf->buf = new;
+	buf->buflen += delta;
+	return true;
+}
+
+static void build(struct blob_buf *b, bool reserve)
+{
+	char name[16];
+	void *c;
+	int len, i;
+
+	blob_buf_init(b, 0);
+	if (reserve)
+		blob_buf_reserve(b, entries * 48);
+
+	c = blobmsg_open_table(b, "entries");
+	for (i = 0; i < entries; i++) {
+		len = b->buflen;
+		snprintf(name, sizeof(name), "e%d", i);
+		if (i % 2)
+			blobmsg_add_u32(b, name, i);
+		else
+			blobmsg_add_string(b, name, "value");
+
+		if (b->buflen != len)
+			grows++;
+	}
+	blobmsg_close_table(b, c);
+}
+
+static void run(const char *name, bool linear, bool reserve, int rounds)
+{
+	struct blob_buf b = {};
+	double start, t;
+	int i;
+
+	grows = 0;
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		if (linear)
+			b.grow = linear_grow;
+
+		build(&b, reserve);
+		blob_buf_free(&b);
+		b.grow = NULL;
+	}
+	t = (now() - start) / rounds;
+
+	printf("%-10s %8.2f ms per table, %6d reallocs\n", name, t * 1000,
+	       grows / rounds);
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = 10;
+
+	if (argc > 1)
+		entries = atoi(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	if (entries <= 0 || rounds <= 0)
+		return 1;
+
+	run("linear", true, false, rounds);
+	run("geometric", false, false, rounds);
+	run("reserve", false, true, rounds);
+
+	return 0;
+}
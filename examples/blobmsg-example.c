@@ -32,6 +32,11 @@ dump_table(struct blob_attr *head, int len, int indent, bool array)
 
 static void dump_attr_data(void *data, int len, int type, int indent, int next_indent)
 {
+	union {
+		uint64_t u64;
+		double d;
+	} v;
+
 	switch(type) {
 	case BLOBMSG_TYPE_STRING:
 		indent_printf(indent, "%s\n", (char *) data);
@@ -48,6 +53,11 @@ static void dump_attr_data(void *data, int len, int type, int indent, int next_i
 	case BLOBMSG_TYPE_INT64:
 		indent_printf(indent, "%lld\n", *(uint64_t *)data);
 		break;
+	case BLOBMSG_TYPE_DOUBLE:
+		memcpy(&v.u64, data, sizeof(v.u64));
+		v.u64 = be64_to_cpu(v.u64);
+		indent_printf(indent, "%g\n", v.d);
+		break;
 	case BLOBMSG_TYPE_TABLE:
 	case BLOBMSG_TYPE_ARRAY:
 		if (!indent)
@@ -113,6 +123,7 @@ fill_message(struct blob_buf *buf)
 	tbl = blobmsg_open_table(buf, "testdata");
 	blobmsg_add_u32(buf, "hello", 1);
 	blobmsg_add_string(buf, "world", "2");
+	blobmsg_add_double(buf, "pi", 3.14159);
 	blobmsg_close_table(buf, tbl);
 
 	tbl = blobmsg_open_array(buf, "list");
@@ -0,0 +1,109 @@
+/*
+ * blobmsg-format-bench.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Formats a large nested blobmsg table as JSON, with and without
+ * indentation.
+ *
+ * usage: blobmsg-format-bench [<entries> [<rounds>]]
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "blobmsg_json.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void build(struct blob_buf *b, int entries)
+{
+	char name[32];
+	void *c, *e, *t;
+	int i;
+
+	blobmsg_buf_init(b);
+	c = blobmsg_open_array(b, "hosts");
+	for (i = 0; i < entries; i++) {
+		e = blobmsg_open_table(b, NULL);
+		blobmsg_add_u32(b, "id", i);
+		snprintf(name, sizeof(name), "host-%d", i);
+		blobmsg_add_string(b, "name", name);
+		blobmsg_add_string(b, "descr", "line one\nline \"two\"\tend");
+		blobmsg_add_u8(b, "up", i % 7);
+		blobmsg_add_u16(b, "port", i & 0xffff);
+		blobmsg_add_u64(b, "rx_bytes", (uint64_t) i * 1234567891ULL);
+
+		t = blobmsg_open_table(b, "stats");
+		blobmsg_add_u32(b, "errors", -i);
+		blobmsg_add_u32(b, "drops", i * 3);
+		blobmsg_close_table(b, t);
+		blobmsg_close_table(b, e);
+	}
+	blobmsg_close_array(b, c);
+}
+
+static void run(const char *name, struct blob_buf *b, int indent, int rounds)
+{
+	double start, t;
+	char *str;
+	int len = 0;
+	int i;
+
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		str = blobmsg_format_json_indent(b->head, true, indent);
+		if (!str) {
+			fprintf(stderr, "%s: format failed\n", name);
+			exit(1);
+		}
+
+		len = strlen(str);
+		free(str);
+	}
+	t = (now() - start) / rounds;
+
+	printf("%-8s %8.2f ms, %7.1f MB/s, %d bytes of JSON\n", name,
+	       t * 1000, len / t / 1e6, len);
+}
+
+int main(int argc, char **argv)
+{
+	struct blob_buf b = {};
+	int entries = 20000, rounds = 10;
+
+	if (argc > 1)
+		entries = atoi(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	if (entries <= 0 || rounds <= 0)
+		return 1;
+
+	build(&b, entries);
+	printf("blobmsg: %d bytes\n", blob_pad_len(b.head));
+	run("compact", &b, -1, rounds);
+	run("indent", &b, 0, rounds);
+	blob_buf_free(&b);
+
+	return 0;
+}
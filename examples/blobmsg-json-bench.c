@@ -0,0 +1,133 @@
+/*
+ * blobmsg-json-bench.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Converts a JSON document to blobmsg with blobmsg_add_json_from_string
+ * (json-c object tree) and with the native blobmsg_add_json_buf parser.
+ *
+ * usage: blobmsg-json-bench [<file> [<rounds>]]
+ * without a file, a generated document of ~4 MB is used.
+ */
+
+#include <sys/stat.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blobmsg_json.h"
+#include "blobmsg_json_parse.h"
+
+static char *payload;
+static int total;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, bool native, int rounds)
+{
+	struct blob_buf b = {};
+	double start, t;
+	bool ret;
+	int i;
+
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		blob_buf_init(&b, 0);
+		if (native)
+			ret = blobmsg_add_json_buf(&b, payload, total);
+		else
+			ret = blobmsg_add_json_from_string(&b, payload);
+
+		if (!ret) {
+			fprintf(stderr, "%s: parse failed\n", name);
+			exit(1);
+		}
+	}
+	t = (now() - start) / rounds;
+
+	printf("%-8s %8.2f ms, %7.1f MB/s, %d bytes of blobmsg\n", name,
+	       t * 1000, total / t / 1e6, blob_pad_len(b.head));
+	blob_buf_free(&b);
+}
+
+static void generate(void)
+{
+	int len = 0, size = 4 * 1024 * 1024;
+	int i = 0;
+
+	payload = malloc(size + 256);
+	len += sprintf(payload, "{ \"hosts\": [");
+	while (len < size) {
+		len += sprintf(payload + len,
+			       "%s{ \"id\": %d, \"name\": \"host-%d\", \"addr\": \"10.%d.%d.%d\", "
+			       "\"up\": %s, \"rx_bytes\": %u, \"descr\": \"line\\t%d\\n\" }",
+			       i ? ", " : "", i, i, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff,
+			       i % 7 ? "true" : "false", (unsigned) random() >> 1, i);
+		i++;
+	}
+	len += sprintf(payload + len, "] }");
+	total = len;
+}
+
+static void load(const char *file)
+{
+	struct stat st;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f || fstat(fileno(f), &st) < 0) {
+		perror("fopen");
+		exit(1);
+	}
+
+	total = st.st_size;
+	payload = malloc(total + 1);
+	if (!payload || fread(payload, 1, total, f) != total) {
+		perror("fread");
+		exit(1);
+	}
+
+	payload[total] = 0;
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = 20;
+
+	if (argc > 1)
+		load(argv[1]);
+	else
+		generate();
+
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	if (!total || rounds <= 0)
+		return 1;
+
+	printf("payload: %d bytes\n", total);
+	run("json-c", false, rounds);
+	run("native", true, rounds);
+
+	return 0;
+}
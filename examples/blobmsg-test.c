@@ -0,0 +1,196 @@
+/*
+ * blobmsg-test.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Regression checks for blob buffer handling, best run under a memory
+ * checker. exits with 1 on the first failed check.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "blobmsg.h"
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+static void string_name(char *buf, int i)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz";
+	int len = i % 7 + 1;
+
+	buf[len] = 0;
+	while (len-- > 0)
+		buf[len] = chars[(i + len) % 26];
+}
+
+/* odd sized attributes must not be padded past the end of a grown buffer */
+static void test_grow_padding(void)
+{
+	static char storage[37];
+	struct blob_buf b = {};
+	struct blob_attr *cur;
+	char str[8];
+	int i, rem, len = 0, grows = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (i)
+			blob_buf_init_external(&b, 0, storage, sizeof(storage));
+		else
+			blob_buf_init(&b, 0);
+
+		for (len = b.buflen, grows = 0; grows < 8; ) {
+			string_name(str, grows * 1000 + blob_len(b.head));
+			check(blobmsg_add_string(&b, "s", str) == 0);
+			check(b.buflen % BLOB_ATTR_ALIGN == 0);
+			if (b.buflen != len) {
+				len = b.buflen;
+				grows++;
+			}
+		}
+
+		blobmsg_for_each_attr(cur, b.head, rem)
+			check(blobmsg_type(cur) == BLOBMSG_TYPE_STRING);
+		check(rem == 0);
+
+		blob_buf_free(&b);
+	}
+}
+
+struct decode_test {
+	uint32_t a;
+	const char *bb;
+	const char *a_str;
+	struct blob_attr *cc;
+	struct blob_attr *ddd;
+};
+
+static const struct blobmsg_field decode_fields[] = {
+	{ BLOBMSG_FIELD(struct decode_test, a, "a", BLOBMSG_TYPE_INT32) },
+	{ BLOBMSG_FIELD(struct decode_test, bb, "bb", BLOBMSG_TYPE_STRING) },
+	{ BLOBMSG_FIELD(struct decode_test, a_str, "a", BLOBMSG_TYPE_STRING) },
+	{ BLOBMSG_FIELD(struct decode_test, cc, "cc", BLOBMSG_TYPE_UNSPEC) },
+	{ BLOBMSG_FIELD(struct decode_test, ddd, "ddd", BLOBMSG_TYPE_TABLE) },
+};
+
+#define N_DECODE	ARRAY_SIZE(decode_fields)
+
+static void add_random_attr(struct blob_buf *b)
+{
+	static const char *names[] = { "a", "b", "bb", "xy", "cc", "ddd", "eee", "" };
+	const char *name = names[rand() % ARRAY_SIZE(names)];
+	void *c;
+
+	switch (rand() % 4) {
+	case 0:
+		blobmsg_add_u32(b, name, rand());
+		break;
+	case 1:
+		blobmsg_add_string(b, name, "x");
+		break;
+	case 2:
+		c = blobmsg_open_table(b, name);
+		blobmsg_add_u8(b, "q", 1);
+		blobmsg_close_table(b, c);
+		break;
+	case 3:
+		blobmsg_add_u16(b, name, 3);
+		break;
+	}
+}
+
+static bool has_short_attr(struct blob_attr *head)
+{
+	struct blob_attr *cur;
+	int rem = blob_len(head);
+
+	__blob_for_each_attr(cur, blob_data(head), rem)
+		if (blob_len(cur) < sizeof(struct blobmsg_hdr))
+			return true;
+
+	return false;
+}
+
+/*
+ * blobmsg_parse_compiled and blobmsg_decode must reject the same malformed
+ * messages as blobmsg_parse, also when the name of the broken attribute
+ * is not in the policy
+ */
+static void test_parse_validation(void)
+{
+	struct blobmsg_policy policy[N_DECODE];
+	struct blobmsg_compiled_policy *cp;
+	struct blob_attr *tb[N_DECODE], *tb_cp[N_DECODE];
+	struct blobmsg_decoder *d;
+	struct decode_test dt;
+	struct blob_buf b = {};
+	unsigned char *data;
+	int i, n, ret, ret_cp, ret_d;
+
+	for (i = 0; i < N_DECODE; i++) {
+		policy[i].name = decode_fields[i].name;
+		policy[i].type = decode_fields[i].type;
+	}
+
+	cp = blobmsg_policy_compile(policy, N_DECODE);
+	d = blobmsg_decoder_new(decode_fields, N_DECODE);
+	check(cp && d);
+
+	srand(1);
+	for (i = 0; i < 100000; i++) {
+		blob_buf_init(&b, 0);
+		for (n = rand() % 6; n > 0; n--)
+			add_random_attr(&b);
+
+		/* flip a random bit */
+		if (rand() % 2 && blob_len(b.head) > 0) {
+			data = blob_data(b.head);
+			data[rand() % blob_len(b.head)] ^= 1 << (rand() % 8);
+		}
+
+		ret_cp = blobmsg_parse_compiled(cp, tb_cp, blob_data(b.head), blob_len(b.head));
+		ret_d = blobmsg_decode(d, &dt, blob_data(b.head), blob_len(b.head));
+		check((ret_cp < 0) == (ret_d < 0));
+
+		/* blobmsg_parse reads the header of these from past the attribute */
+		if (has_short_attr(b.head)) {
+			check(ret_cp < 0);
+			continue;
+		}
+
+		ret = blobmsg_parse(policy, N_DECODE, tb, blob_data(b.head), blob_len(b.head));
+		check(ret == ret_cp);
+		if (ret == 0)
+			check(!memcmp(tb, tb_cp, sizeof(tb)));
+	}
+
+	blob_buf_free(&b);
+	blobmsg_decoder_free(d);
+	blobmsg_policy_compiled_free(cp);
+}
+
+int main(int argc, char **argv)
+{
+	test_grow_padding();
+	test_parse_validation();
+
+	return 0;
+}
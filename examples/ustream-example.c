@@ -24,23 +24,14 @@ struct client {
 static void client_read_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, s.stream);
-	struct ustream_buf *buf = s->r.head;
-	char *newline, *str;
+	char *str;
+	int len;
 
-	do {
-		str = ustream_get_read_buf(s, NULL);
-		if (!str)
-			break;
-
-		newline = strchr(buf->data, '\n');
-		if (!newline)
-			break;
-
-		*newline = 0;
-		ustream_printf(s, "%s\n", str);
-		ustream_consume(s, newline + 1 - str);
-		cl->ctr += newline + 1 - str;
-	} while(1);
+	while ((str = ustream_get_line(s, &len)) != NULL) {
+		ustream_write(s, str, len, false);
+		ustream_consume(s, len);
+		cl->ctr += len;
+	}
 
 	if (s->w.data_bytes > 256 && !ustream_read_blocked(s)) {
 		fprintf(stderr, "Block read, bytes: %d\n", s->w.data_bytes);
@@ -0,0 +1,211 @@
+/*
+ * ustream-proxy-bench.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Proxies data from a writer process to a reader process through two
+ * ustream_fd in this process: with hand-written notify_read/notify_write
+ * callbacks, with ustream_forward_init and with ustream_fd_splice.
+ *
+ * usage: ustream-proxy-bench [<total MB> [<read buffer size>]]
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+enum {
+	MODE_COPY,
+	MODE_FORWARD,
+	MODE_SPLICE,
+};
+
+static struct ustream_fd in, out;
+static long long total;
+static int buffer_len = 16384;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t writer(int fd)
+{
+	static char buf[65536];
+	long long left = total;
+	pid_t pid;
+	ssize_t len;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	while (left > 0) {
+		len = write(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+		if (len < 0)
+			exit(1);
+
+		left -= len;
+	}
+
+	exit(0);
+}
+
+static pid_t reader(int fd)
+{
+	static char buf[65536];
+	long long done = 0;
+	pid_t pid;
+	ssize_t len;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	while (done < total && (len = read(fd, buf, sizeof(buf))) > 0)
+		done += len;
+
+	/* report back through the proxied socket */
+	if (write(fd, "", 1) < 0)
+		exit(1);
+
+	exit(done != total);
+}
+
+static void reader_done(struct ustream *s, int bytes)
+{
+	uloop_end();
+}
+
+static void copy_notify_read(struct ustream *s, int bytes)
+{
+	char *buf;
+	int len;
+
+	while (out.stream.w.data_bytes < 65536 &&
+	       (buf = ustream_get_read_buf(s, &len)) != NULL) {
+		len = ustream_write(&out.stream, buf, len, false);
+		if (len <= 0)
+			break;
+
+		ustream_consume(s, len);
+	}
+
+	ustream_set_read_blocked(s, out.stream.w.data_bytes >= 65536);
+}
+
+static void copy_notify_write(struct ustream *s, int bytes)
+{
+	copy_notify_read(&in.stream, 0);
+}
+
+static void run(const char *name, int mode)
+{
+	struct ustream_forward f = {};
+	int sv_in[2], sv_out[2];
+	int status, ret = 0;
+	double start;
+	pid_t pid_w, pid_r;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv_in) < 0 ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, sv_out) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	start = now();
+	pid_w = writer(sv_in[1]);
+	pid_r = reader(sv_out[1]);
+	close(sv_in[1]);
+	close(sv_out[1]);
+
+	uloop_init();
+	memset(&in, 0, sizeof(in));
+	memset(&out, 0, sizeof(out));
+	in.stream.r.buffer_len = buffer_len;
+	in.stream.r.max_buffers = 4;
+	out.stream.notify_read = reader_done;
+	ustream_fd_init(&in, sv_in[0]);
+	ustream_fd_init(&out, sv_out[0]);
+
+	switch (mode) {
+	case MODE_COPY:
+		in.stream.notify_read = copy_notify_read;
+		out.stream.notify_write = copy_notify_write;
+		break;
+	case MODE_FORWARD:
+		ustream_forward_init(&f, &in.stream, &out.stream);
+		break;
+	case MODE_SPLICE:
+		if (ustream_fd_splice(&in, &out.stream) < 0) {
+			fprintf(stderr, "%-10s not supported\n", name);
+			kill(pid_w, SIGTERM);
+			kill(pid_r, SIGTERM);
+			ret = -1;
+		}
+		break;
+	}
+
+	if (!ret)
+		uloop_run();
+	uloop_cancelled = false;
+
+	if (mode == MODE_FORWARD)
+		ustream_forward_stop(&f);
+	ustream_free(&in.stream);
+	ustream_free(&out.stream);
+	close(sv_in[0]);
+	close(sv_out[0]);
+	uloop_done();
+
+	waitpid(pid_w, NULL, 0);
+	waitpid(pid_r, &status, 0);
+	if (ret)
+		return;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		fprintf(stderr, "%-10s data mismatch\n", name);
+
+	printf("%-10s %lld bytes, %.3f s, %.1f MB/s\n", name, total,
+	       now() - start, total / (now() - start) / 1e6);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	total = argc > 1 ? atoll(argv[1]) : 1024;
+	total *= 1024 * 1024;
+	if (argc > 2)
+		buffer_len = atoi(argv[2]);
+
+	if (total <= 0 || buffer_len <= 0)
+		return 1;
+
+	run("copy", MODE_COPY);
+	run("forward", MODE_FORWARD);
+	run("splice", MODE_SPLICE);
+
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * ustream-shm-bench.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Sends a number of fixed size messages from a child process to its parent,
+ * over a shared memory ustream and over a ustream_fd on a socketpair.
+ * The "shm-partial" run leaves the last received byte in the read buffer
+ * every time, like a line based protocol waiting for the rest of a line,
+ * and checks the received data.
+ *
+ * usage: ustream-shm-bench [<message size> [<total MB>]]
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+static long long total, done;
+static int msg_len = 64;
+static char *msg;
+static bool partial;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void writer_notify_write(struct ustream *s, int bytes)
+{
+	while (done < total && s->w.data_bytes < 65536) {
+		ustream_write(s, msg, msg_len, true);
+		done += msg_len;
+	}
+
+	if (done >= total && !s->w.data_bytes)
+		uloop_end();
+}
+
+static void reader_check(const char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != msg[(done + i) % msg_len]) {
+			fprintf(stderr, "data mismatch at offset %lld\n", done + i);
+			exit(1);
+		}
+	}
+}
+
+static void reader_notify_read(struct ustream *s, int bytes)
+{
+	char *buf;
+	int len;
+
+	while ((buf = ustream_get_read_buf(s, &len)) != NULL) {
+		if (partial) {
+			if (len < 2)
+				break;
+
+			len--;
+			reader_check(buf, len);
+		} else {
+			len -= len % msg_len;
+			if (!len)
+				break;
+		}
+
+		done += len;
+		ustream_consume(s, len);
+	}
+}
+
+static void reader_notify_state(struct ustream *s)
+{
+	char *buf;
+	int len;
+
+	buf = ustream_get_read_buf(s, &len);
+	if (partial && buf) {
+		reader_check(buf, len);
+		done += len;
+		ustream_consume(s, len);
+	}
+
+	uloop_end();
+}
+
+static void run(const char *name, struct ustream *s, bool writer)
+{
+	double start = now();
+
+	done = 0;
+	if (writer) {
+		s->notify_write = writer_notify_write;
+		writer_notify_write(s, 0);
+	} else {
+		s->notify_read = reader_notify_read;
+		s->notify_state = reader_notify_state;
+	}
+
+	uloop_run();
+	uloop_cancelled = false;
+
+	if (writer)
+		return;
+
+	printf("%-10s %lld bytes, %.3f s, %.1f MB/s, %.2f Mmsg/s\n", name, done,
+	       now() - start, done / (now() - start) / 1e6,
+	       done / msg_len / (now() - start) / 1e6);
+	fflush(stdout);
+}
+
+static void bench_shm(const char *name)
+{
+	struct ustream_shm sh = {};
+	int fds[3], side;
+	pid_t pid;
+
+	if (ustream_shm_create(256 * 1024, fds) < 0) {
+		perror("ustream_shm_create");
+		exit(1);
+	}
+
+	pid = fork();
+	side = !pid;
+
+	uloop_init();
+	if (ustream_shm_init(&sh, fds, side) < 0) {
+		perror("ustream_shm_init");
+		exit(1);
+	}
+
+	run(name, &sh.stream, !pid);
+	ustream_free(&sh.stream);
+	uloop_done();
+
+	if (!pid)
+		exit(0);
+
+	waitpid(pid, NULL, 0);
+}
+
+static void bench_fd(void)
+{
+	struct ustream_fd sf = {};
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	pid = fork();
+	close(sv[!pid]);
+
+	uloop_init();
+	sf.stream.r.max_buffers = 4;
+	ustream_fd_init(&sf, sv[!!pid]);
+	run("socketpair", &sf.stream, !pid);
+	ustream_free(&sf.stream);
+	close(sv[!!pid]);
+	uloop_done();
+
+	if (!pid)
+		exit(0);
+
+	waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if (argc > 1)
+		msg_len = atoi(argv[1]);
+	total = argc > 2 ? atoll(argv[2]) : 512;
+	total *= 1024 * 1024;
+
+	if (msg_len <= 0 || total <= 0)
+		return 1;
+
+	total -= total % msg_len;
+	msg = malloc(msg_len);
+	for (i = 0; i < msg_len; i++)
+		msg[i] = i * 7 + 1;
+
+	bench_shm("shm");
+	partial = true;
+	bench_shm("shm-partial");
+	partial = false;
+	bench_fd();
+
+	return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * ustream-test.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Regression checks for ustream buffer handling, best run under a memory
+ * checker. exits with 1 on the first failed check.
+ */
+
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ustream.h"
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+static int lines;
+
+static void line_read_cb(struct ustream *s, int bytes)
+{
+	char *line;
+	int len;
+
+	while ((line = ustream_get_line(s, &len)) != NULL) {
+		lines++;
+		ustream_consume(s, len);
+	}
+}
+
+static void end_cb(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+static void run_loop(int msecs)
+{
+	struct uloop_timeout t = { .cb = end_cb };
+
+	uloop_cancelled = false;
+	uloop_timeout_set(&t, msecs);
+	uloop_run();
+	uloop_timeout_cancel(&t);
+}
+
+/* adaptive read buffers grow for a burst and return to the defaults when idle */
+static void test_adaptive_cycle(void)
+{
+	struct ustream_fd sf = {};
+	struct ustream *s = &sf.stream;
+	static char big[300000];
+	int sv[2], len, max_buffers, ofs, wr, i;
+
+	check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	s->notify_read = line_read_cb;
+	ustream_fd_init(&sf, sv[0]);
+	ustream_set_adaptive(s, true);
+	len = s->r.buffer_len;
+	max_buffers = s->r.max_buffers;
+
+	/* a line larger than all read buffers at the maximum buffer size */
+	memset(big, 'x', sizeof(big));
+	big[sizeof(big) - 1] = '\n';
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	for (ofs = 0; ofs < sizeof(big); ofs += wr > 0 ? wr : 0) {
+		wr = write(sv[1], big + ofs, sizeof(big) - ofs);
+		ustream_poll(s);
+	}
+	while (ustream_poll(s))
+		;
+	check(lines == 1);
+	check(s->r.buffer_len > len && s->r.max_buffers > max_buffers);
+
+	/* the first idle period releases the buffers, the next one scales down */
+	for (i = 0; i < 4; i++) {
+		if (s->r.buffer_len == len && s->r.max_buffers == max_buffers)
+			break;
+
+		run_loop(1100);
+	}
+	check(!s->r.buffers);
+	check(s->r.buffer_len == len);
+	check(s->r.max_buffers == max_buffers);
+
+	ustream_free(s);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static int write_calls;
+
+/* accepts the first write, fails all following ones */
+static int fail_write_cb(struct ustream *s, const char *buf, int len, bool more)
+{
+	return write_calls++ ? -1 : len;
+}
+
+/* escaped writes stop at the first failed write and report it */
+static void test_escaped_write_error(void)
+{
+	struct ustream s = {};
+	char str[601];
+
+	memset(str, 'a', 300);
+	str[300] = '"';
+	memset(str + 301, 'b', 300);
+
+	s.write = fail_write_cb;
+	ustream_init_defaults(&s);
+	check(ustream_write_escaped(&s, str, sizeof(str)) == -1);
+	check(write_calls == 2);
+	check(s.write_error);
+	ustream_free(&s);
+}
+
+int main(int argc, char **argv)
+{
+	uloop_init();
+	test_adaptive_cycle();
+	test_escaped_write_error();
+	uloop_done();
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * ustream-zlib-bench.c
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Sends a payload through a pair of ustream_zlib streams over a socketpair
+ * at different compression levels, and reports the CPU time used and the
+ * number of bytes on the wire.
+ *
+ * usage: ustream-zlib-bench [<file>]
+ * without a file, a generated JSON document of ~64 MB is used.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream-zlib.h"
+
+static struct ustream_fd tx_fd, rx_fd;
+static struct ustream_zlib tx_z, rx_z;
+static struct ustream *tx, *rx;
+static char *payload;
+static long long total, sent, received;
+
+static void send_more(struct ustream *s, int bytes)
+{
+	int len;
+
+	while (sent < total && !s->w.data_bytes) {
+		len = total - sent > 4096 ? 4096 : total - sent;
+		ustream_write(s, payload + sent, len, sent + len < total);
+		sent += len;
+	}
+}
+
+static void recv_data(struct ustream *s, int bytes)
+{
+	char *buf;
+	int len;
+
+	while ((buf = ustream_get_read_buf(s, &len)) != NULL) {
+		if (memcmp(buf, payload + received, len) != 0) {
+			fprintf(stderr, "data mismatch at %lld\n", received);
+			exit(1);
+		}
+
+		received += len;
+		ustream_consume(s, len);
+	}
+
+	if (received == total)
+		uloop_end();
+}
+
+static void run(int level)
+{
+	struct ustream_stats stats = {};
+	char name[32] = "plain";
+	clock_t start;
+	double cpu;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	memset(&tx_fd, 0, sizeof(tx_fd));
+	memset(&rx_fd, 0, sizeof(rx_fd));
+	memset(&tx_z, 0, sizeof(tx_z));
+	memset(&rx_z, 0, sizeof(rx_z));
+	tx_fd.stream.stats = &stats;
+	ustream_fd_init(&tx_fd, sv[0]);
+	ustream_fd_init(&rx_fd, sv[1]);
+
+	tx = &tx_fd.stream;
+	rx = &rx_fd.stream;
+	if (level >= 0) {
+		ustream_zlib_init(&tx_z, tx, level);
+		ustream_zlib_init(&rx_z, rx, level);
+		tx = &tx_z.stream;
+		rx = &rx_z.stream;
+		snprintf(name, sizeof(name), "level %d", level);
+	}
+
+	tx->notify_write = send_more;
+	rx->notify_read = recv_data;
+
+	sent = received = 0;
+	start = clock();
+	send_more(tx, 0);
+	uloop_run();
+	uloop_cancelled = false;
+	cpu = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%-8s %10llu bytes on the wire (%5.1f%%), %.3f s cpu, %.1f MB/s\n",
+	       name, stats.tx_bytes, stats.tx_bytes * 100.0 / total, cpu,
+	       total / cpu / 1e6);
+	fflush(stdout);
+
+	if (level >= 0) {
+		ustream_free(&tx_z.stream);
+		ustream_free(&rx_z.stream);
+	}
+	ustream_free(&tx_fd.stream);
+	ustream_free(&rx_fd.stream);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void generate(void)
+{
+	long long len = 0, size = 64 * 1024 * 1024;
+	int i = 0;
+
+	payload = malloc(size + 256);
+	len += sprintf(payload, "{ \"hosts\": [");
+	while (len < size) {
+		len += sprintf(payload + len,
+			       "%s{ \"id\": %d, \"name\": \"host-%d\", \"addr\": \"10.%d.%d.%d\", "
+			       "\"up\": %s, \"rx_bytes\": %u, \"tx_bytes\": %u }",
+			       i ? ", " : "", i, i, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff,
+			       i % 7 ? "true" : "false", (unsigned) random(), (unsigned) random() % 100000);
+		i++;
+	}
+	len += sprintf(payload + len, "] }");
+	total = len;
+}
+
+static void load(const char *file)
+{
+	struct stat st;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f || fstat(fileno(f), &st) < 0) {
+		perror("fopen");
+		exit(1);
+	}
+
+	total = st.st_size;
+	payload = malloc(total);
+	if (!payload || fread(payload, 1, total, f) != total) {
+		perror("fread");
+		exit(1);
+	}
+
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	static const int levels[] = { -1, 0, 1, 3, 6, 9 };
+	int i;
+
+	if (argc > 1)
+		load(argv[1]);
+	else
+		generate();
+
+	if (!total)
+		return 1;
+
+	uloop_init();
+	printf("payload: %lld bytes\n", total);
+	for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+		run(levels[i]);
+	uloop_done();
+
+	return 0;
+}
@@ -23,9 +23,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <ctype.h>
+#include <math.h>
 #include <getopt.h>
 #include "list.h"
+#include "blobmsg_json_parse.h"
 
 #define MAX_VARLEN	256
 
@@ -89,6 +92,14 @@ static void write_key_string(const char *key)
 	}
 }
 
+static void write_double(double val)
+{
+	char buf[BLOBMSG_JSON_DOUBLE_LEN];
+
+	blobmsg_json_format_double(buf, val);
+	fputs(buf, stdout);
+}
+
 static int add_json_element(const char *key, json_object *obj)
 {
 	char *type;
@@ -113,6 +124,10 @@ static int add_json_element(const char *key, json_object *obj)
 		type = "int";
 		break;
 	case json_type_double:
+		/* NaN and Infinity are not valid JSON, treated like null */
+		if (!isfinite(json_object_get_double(obj)))
+			return -1;
+
 		type = "double";
 		break;
 	default:
@@ -142,10 +157,12 @@ static int add_json_element(const char *key, json_object *obj)
 		fprintf(stdout, "' %d;\n", json_object_get_boolean(obj));
 		break;
 	case json_type_int:
-		fprintf(stdout, "' %d;\n", json_object_get_int(obj));
+		fprintf(stdout, "' %" PRId64 ";\n", json_object_get_int64(obj));
 		break;
 	case json_type_double:
-		fprintf(stdout, "' %lf;\n", json_object_get_double(obj));
+		fprintf(stdout, "' ");
+		write_double(json_object_get_double(obj));
+		fprintf(stdout, ";\n");
 		break;
 	default:
 		return -1;
@@ -203,6 +220,7 @@ static void jshn_add_object_var(json_object *obj, bool array, const char *prefix
 {
 	json_object *new;
 	char *var, *type;
+	double val;
 
 	get_var(prefix, &name, &var, &type);
 	if (!var || !type)
@@ -217,9 +235,11 @@ static void jshn_add_object_var(json_object *obj, bool array, const char *prefix
 	} else if (!strcmp(type, "string")) {
 		new = json_object_new_string(var);
 	} else if (!strcmp(type, "int")) {
-		new = json_object_new_int(atoi(var));
+		new = json_object_new_int64(strtoll(var, NULL, 10));
 	} else if (!strcmp(type, "double")) {
-		new = json_object_new_double(strtod(var, NULL));
+		/* written as null if it is not representable in JSON */
+		val = blobmsg_json_strtod(var);
+		new = isfinite(val) ? json_object_new_double(val) : NULL;
 	} else if (!strcmp(type, "boolean")) {
 		new = json_object_new_boolean(!!atoi(var));
 	} else {
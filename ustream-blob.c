@@ -0,0 +1,208 @@
+/*
+ * ustream - library for stream buffer management
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include "ustream.h"
+#include "blobmsg.h"
+#include "blobmsg_json_parse.h"
+
+static bool ustream_blob_check_list(void *data, int len, bool name)
+{
+	struct blob_attr *cur;
+	int rem = len;
+
+	__blob_for_each_attr(cur, data, rem) {
+		if (blob_is_extended(cur) && !blobmsg_check_attr(cur, name))
+			return false;
+	}
+
+	return !rem;
+}
+
+static bool ustream_blob_check(struct blob_attr *msg)
+{
+	if (blob_is_extended(msg)) {
+		if (!blobmsg_check_attr(msg, false))
+			return false;
+
+		switch (blobmsg_type(msg)) {
+		case BLOBMSG_TYPE_TABLE:
+			return ustream_blob_check_list(blobmsg_data(msg), blobmsg_data_len(msg), true);
+		case BLOBMSG_TYPE_ARRAY:
+			return ustream_blob_check_list(blobmsg_data(msg), blobmsg_data_len(msg), false);
+		default:
+			return true;
+		}
+	}
+
+	/*
+	 * plain messages are containers if they have the id of a blob_buf
+	 * head (as used by ustream_blob_write_buf) or BLOB_ATTR_NESTED,
+	 * anything else is a leaf value
+	 */
+	switch (blob_id(msg)) {
+	case BLOB_ATTR_UNSPEC:
+	case BLOB_ATTR_NESTED:
+		return ustream_blob_check_list(blob_data(msg), blob_len(msg), false);
+	default:
+		return true;
+	}
+}
+
+/* largest message that fits into the read buffers of s */
+static int ustream_blob_max_len(struct ustream *s)
+{
+	struct ustream_buf_list *l = &s->r;
+
+	if (l->ring)
+		return l->buffer_len - 1;
+
+	if (l->max_buffers <= 0)
+		return INT_MAX;
+
+	return l->max_buffers * l->buffer_len;
+}
+
+int ustream_blob_recv(struct ustream *s, int max_len,
+		      void (*cb)(struct ustream *s, struct blob_attr *msg, void *priv),
+		      void *priv)
+{
+	struct blob_attr *msg;
+	int len, pad_len, n = 0;
+	char *data;
+
+	if (max_len <= 0 || max_len > ustream_blob_max_len(s))
+		max_len = ustream_blob_max_len(s);
+
+	while ((data = ustream_get_read_buf(s, &len)) != NULL) {
+		if (len < sizeof(struct blob_attr)) {
+			data = ustream_peek(s, sizeof(struct blob_attr));
+			if (!data)
+				break;
+
+			len = sizeof(struct blob_attr);
+		}
+
+		msg = (struct blob_attr *) data;
+		if (blob_raw_len(msg) < sizeof(struct blob_attr))
+			return -1;
+
+		pad_len = blob_pad_len(msg);
+		if (pad_len > max_len)
+			return -1;
+
+		if (len < pad_len) {
+			msg = (struct blob_attr *) ustream_peek(s, pad_len);
+			if (!msg)
+				break;
+		}
+
+		if (!ustream_blob_check(msg))
+			return -1;
+
+		cb(s, msg, priv);
+		ustream_consume(s, pad_len);
+		n++;
+	}
+
+	return n;
+}
+
+int ustream_json_recv(struct ustream *s, struct blobmsg_json_parser *p)
+{
+	char *data;
+	int len;
+
+	while (!p->done && (data = ustream_get_read_buf(s, &len)) != NULL) {
+		len = blobmsg_json_parser_feed(p, data, len);
+		if (len < 0)
+			return -1;
+
+		ustream_consume(s, len);
+	}
+
+	return p->done;
+}
+
+int ustream_blob_write(struct ustream *s, struct blob_attr *msg)
+{
+	return ustream_write(s, (const char *) msg, blob_pad_len(msg), false);
+}
+
+int ustream_blob_write_buf(struct ustream *s, struct blob_buf *b)
+{
+	struct blob_attr *msg = b->head;
+	void *buf = b->buf;
+
+	/* caller provided storage can't be handed over */
+	if (blob_buf_is_external(b))
+		return ustream_blob_write(s, msg);
+
+	b->head = NULL;
+	b->buf = NULL;
+	b->buflen = 0;
+
+	return ustream_write_ext(s, (const char *) msg, blob_pad_len(msg), false,
+				 free, buf);
+}
+
+static void ustream_dump_stream(struct ustream *s, void *priv)
+{
+	struct ustream_stats *st = s->stats;
+	struct blob_buf *b = priv;
+	void *c;
+
+	c = blobmsg_open_table(b, NULL);
+	if (st && st->name)
+		blobmsg_add_string(b, "name", st->name);
+
+	blobmsg_add_u32(b, "r_bytes", s->r.data_bytes);
+	blobmsg_add_u32(b, "r_buffers", s->r.buffers);
+	blobmsg_add_u32(b, "w_bytes", s->w.data_bytes);
+	blobmsg_add_u32(b, "w_buffers", s->w.buffers);
+	blobmsg_add_u32(b, "read_blocked", s->read_blocked);
+	blobmsg_add_u8(b, "eof", s->eof);
+	blobmsg_add_u8(b, "write_error", s->write_error);
+	blobmsg_add_u8(b, "corked", s->corked);
+	blobmsg_add_u8(b, "throttled", s->throttled);
+
+	if (st) {
+		blobmsg_add_u64(b, "rx_bytes", st->rx_bytes);
+		blobmsg_add_u64(b, "tx_bytes", st->tx_bytes);
+		blobmsg_add_u64(b, "rx_calls", st->rx_calls);
+		blobmsg_add_u64(b, "tx_calls", st->tx_calls);
+		blobmsg_add_u64(b, "allocs", st->allocs);
+		blobmsg_add_u64(b, "moved", st->moved);
+		blobmsg_add_u64(b, "read_full", st->read_full);
+		blobmsg_add_u64(b, "write_errors", st->write_errors);
+		blobmsg_add_u32(b, "max_w_bytes", st->max_w_bytes);
+		blobmsg_add_u32(b, "max_w_buffers", st->max_w_buffers);
+	}
+
+	blobmsg_close_table(b, c);
+}
+
+void ustream_dump(struct blob_buf *b, const char *name)
+{
+	void *c;
+
+	c = blobmsg_open_array(b, name);
+	ustream_for_each(ustream_dump_stream, b);
+	blobmsg_close_array(b, c);
+}
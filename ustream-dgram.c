@@ -0,0 +1,394 @@
+/*
+ * ustream - library for stream buffer management
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "ustream.h"
+
+#define USTREAM_DGRAM_BATCH	16
+#define USTREAM_DGRAM_MSG_LEN	2048
+
+/* stored in front of the payload of each read buffer */
+struct ustream_dgram_addr {
+	socklen_t len;
+	struct sockaddr_storage addr;
+};
+
+#ifndef __linux__
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+static int recvmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags, void *timeout)
+{
+	ssize_t len = recvmsg(fd, &msgs[0].msg_hdr, flags);
+
+	if (len < 0)
+		return -1;
+
+	msgs[0].msg_len = len;
+	return 1;
+}
+
+static int sendmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	unsigned int i;
+	ssize_t len;
+
+	for (i = 0; i < n; i++) {
+		len = sendmsg(fd, &msgs[i].msg_hdr, flags);
+		if (len < 0)
+			break;
+
+		msgs[i].msg_len = len;
+	}
+
+	if (!i)
+		return -1;
+
+	return i;
+}
+#endif
+
+static struct ustream_dgram_addr *ustream_dgram_buf_addr(struct ustream_buf *buf)
+{
+	return (struct ustream_dgram_addr *) buf->head;
+}
+
+static void ustream_dgram_set_uloop(struct ustream *s, bool write)
+{
+	struct ustream_dgram *d = container_of(s, struct ustream_dgram, stream);
+	unsigned int flags = ULOOP_EDGE_TRIGGER;
+
+	if (!s->read_blocked && !s->eof)
+		flags |= ULOOP_READ;
+
+	if (write || (s->w.data_bytes && !s->write_error &&
+	    !s->corked && !s->throttled))
+		flags |= ULOOP_WRITE;
+
+	uloop_fd_add(&d->fd, flags);
+}
+
+static void ustream_dgram_set_read_blocked(struct ustream *s)
+{
+	ustream_dgram_set_uloop(s, false);
+}
+
+/* move an empty buffer behind all buffers that were filled in this batch */
+static void ustream_dgram_requeue(struct ustream_buf_list *l,
+				  struct ustream_buf *prev, struct ustream_buf *buf)
+{
+	if (!buf->next)
+		return;
+
+	if (prev)
+		prev->next = buf->next;
+	else
+		l->head = buf->next;
+
+	l->tail->next = buf;
+	l->tail = buf;
+	buf->next = NULL;
+}
+
+static void ustream_dgram_read_pending(struct ustream_dgram *d, bool *more)
+{
+	struct ustream *s = &d->stream;
+	struct ustream_buf_list *l = &s->r;
+	struct ustream_buf *bufs[USTREAM_DGRAM_BATCH];
+	struct mmsghdr msgs[USTREAM_DGRAM_BATCH];
+	struct iovec iov[USTREAM_DGRAM_BATCH];
+	struct ustream_buf *buf, *prev;
+	struct ustream_dgram_addr *addr;
+	int i, n, ret, total;
+
+	do {
+		/* collect empty buffers behind the last pending message */
+		prev = l->data_tail;
+		if (prev && prev->tail == prev->data)
+			prev = NULL;
+
+		buf = prev ? prev->next : l->head;
+		for (n = 0; n < USTREAM_DGRAM_BATCH; n++) {
+			if (!buf) {
+				if (l->alloc(s, l) < 0)
+					break;
+
+				buf = l->tail;
+			}
+
+			addr = ustream_dgram_buf_addr(buf);
+			buf->data = buf->tail = (char *) (addr + 1);
+			iov[n].iov_base = buf->data;
+			iov[n].iov_len = buf->end - buf->data;
+
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_name = &addr->addr;
+			msgs[n].msg_hdr.msg_namelen = sizeof(addr->addr);
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+
+			bufs[n] = buf;
+			buf = buf->next;
+		}
+
+		if (!n) {
+			ustream_trace(s, USTREAM_TRACE_READ_FULL, l->data_bytes);
+			s->read_blocked |= READ_BLOCKED_FULL;
+			ustream_dgram_set_uloop(s, false);
+			return;
+		}
+
+		ret = recvmmsg(d->fd.fd, msgs, n, MSG_DONTWAIT, NULL);
+		ustream_stats_rx(s, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			/*
+			 * e.g. ICMP errors on connected datagram sockets: the error
+			 * is cleared by reporting it, more datagrams may be queued
+			 * and the edge triggered fd would not report them again
+			 */
+			if (!d->seqpacket) {
+				if (errno == EBADF || errno == ENOTSOCK)
+					return;
+
+				continue;
+			}
+
+			ret = 0;
+		}
+
+		if (!ret && d->seqpacket) {
+			if (!s->eof)
+				ustream_state_change(s);
+			s->eof = true;
+			ustream_dgram_set_uloop(s, false);
+			return;
+		}
+
+		total = 0;
+		for (i = 0; i < ret; i++) {
+			int len = msgs[i].msg_len;
+
+			buf = bufs[i];
+			if (!len) {
+				if (d->seqpacket) {
+					/* peer has closed, deliver the rest first */
+					s->eof = true;
+					ustream_state_change(s);
+					break;
+				}
+
+				/* empty datagrams can't be represented */
+				ustream_dgram_requeue(l, prev, buf);
+				continue;
+			}
+
+			ustream_dgram_buf_addr(buf)->len = msgs[i].msg_hdr.msg_namelen;
+			buf->tail += len;
+			if (s->string_data)
+				*buf->tail = 0;
+
+			l->data_tail = buf;
+			total += len;
+			prev = buf;
+		}
+
+		if (total) {
+			if (s->stats)
+				s->stats->rx_bytes += total;
+			l->data_bytes += total;
+			if (s->notify_read)
+				s->notify_read(s, total);
+			*more = true;
+		}
+
+		if (s->eof) {
+			ustream_dgram_set_uloop(s, false);
+			return;
+		}
+
+		/* retry after errors, read on while the batch was filled */
+	} while (ret < 0 || ret == n);
+}
+
+static int ustream_dgram_write(struct ustream *s, const char *buf, int buflen, bool more)
+{
+	struct ustream_dgram *d = container_of(s, struct ustream_dgram, stream);
+	ssize_t len;
+
+	do {
+		len = send(d->fd.fd, buf, buflen, MSG_DONTWAIT);
+		ustream_stats_tx(s, len);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		ustream_dgram_set_uloop(s, true);
+		return 0;
+	}
+
+	return buflen;
+}
+
+static int ustream_dgram_writev(struct ustream *s, const struct iovec *iov, int iovcnt, bool more)
+{
+	struct ustream_dgram *d = container_of(s, struct ustream_dgram, stream);
+	struct mmsghdr msgs[USTREAM_DGRAM_BATCH];
+	int i, ret, len = 0;
+
+	if (iovcnt > USTREAM_DGRAM_BATCH)
+		iovcnt = USTREAM_DGRAM_BATCH;
+
+	memset(msgs, 0, iovcnt * sizeof(msgs[0]));
+	for (i = 0; i < iovcnt; i++) {
+		msgs[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	do {
+		ret = sendmmsg(d->fd.fd, msgs, iovcnt, MSG_DONTWAIT);
+		ustream_stats_tx(s, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		ret = 0;
+	}
+
+	for (i = 0; i < ret; i++)
+		len += iov[i].iov_len;
+	if (s->stats)
+		s->stats->tx_bytes += len;
+
+	if (ret < iovcnt)
+		ustream_dgram_set_uloop(s, true);
+
+	return len;
+}
+
+int ustream_dgram_sendto(struct ustream_dgram *d, const char *buf, int len,
+			 const struct sockaddr *addr, socklen_t addrlen)
+{
+	ssize_t ret;
+
+	do {
+		ret = sendto(d->fd.fd, buf, len, MSG_DONTWAIT, addr, addrlen);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+const struct sockaddr *ustream_dgram_get_addr(struct ustream_dgram *d, socklen_t *len)
+{
+	struct ustream_buf *buf = d->stream.r.head;
+	struct ustream_dgram_addr *addr;
+
+	if (!buf || buf->tail == buf->data)
+		return NULL;
+
+	addr = ustream_dgram_buf_addr(buf);
+	if (len)
+		*len = addr->len;
+
+	return (struct sockaddr *) &addr->addr;
+}
+
+static bool __ustream_dgram_poll(struct ustream_dgram *d, unsigned int events)
+{
+	struct ustream *s = &d->stream;
+	bool more = false;
+
+	if (events & ULOOP_READ)
+		ustream_dgram_read_pending(d, &more);
+
+	if (events & ULOOP_WRITE) {
+		if (!ustream_write_pending(s))
+			ustream_dgram_set_uloop(s, false);
+	}
+
+	return more;
+}
+
+static bool ustream_dgram_poll(struct ustream *s)
+{
+	struct ustream_dgram *d = container_of(s, struct ustream_dgram, stream);
+
+	return __ustream_dgram_poll(d, ULOOP_READ | ULOOP_WRITE);
+}
+
+static void ustream_dgram_uloop_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct ustream_dgram *d = container_of(fd, struct ustream_dgram, fd);
+
+	__ustream_dgram_poll(d, events);
+}
+
+static void ustream_dgram_free(struct ustream *s)
+{
+	struct ustream_dgram *d = container_of(s, struct ustream_dgram, stream);
+
+	uloop_fd_delete(&d->fd);
+}
+
+void ustream_dgram_init(struct ustream_dgram *d, int fd)
+{
+	struct ustream *s = &d->stream;
+	socklen_t len = sizeof(int);
+	int type = 0;
+
+	/* unless it is still the value set up by an earlier init */
+	if (s->r.buffer_len != d->msg_len + sizeof(struct ustream_dgram_addr))
+		d->msg_len = s->r.buffer_len;
+	if (!d->msg_len)
+		d->msg_len = USTREAM_DGRAM_MSG_LEN;
+	s->r.buffer_len = d->msg_len + sizeof(struct ustream_dgram_addr);
+
+	if (!s->r.min_buffers)
+		s->r.min_buffers = 4;
+	if (!s->r.max_buffers)
+		s->r.max_buffers = 2 * USTREAM_DGRAM_BATCH;
+
+	ustream_init_defaults(s);
+
+	d->fd.fd = fd;
+	d->seqpacket = !getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) &&
+		       type == SOCK_SEQPACKET;
+	d->fd.cb = ustream_dgram_uloop_cb;
+	s->packet = true;
+	s->set_read_blocked = ustream_dgram_set_read_blocked;
+	s->write = ustream_dgram_write;
+	s->writev = ustream_dgram_writev;
+	s->free = ustream_dgram_free;
+	s->poll = ustream_dgram_poll;
+	ustream_dgram_set_uloop(s, false);
+}
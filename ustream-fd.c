@@ -16,11 +16,33 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "ustream.h"
 
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+struct ustream_splice {
+	struct ustream_fd *src;
+	struct ustream *dst;
+	int pipe[2];
+	int size;
+	int pending;
+	int refcount;
+};
+
 static void ustream_fd_set_uloop(struct ustream *s, bool write)
 {
 	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
@@ -31,7 +53,8 @@ static void ustream_fd_set_uloop(struct ustream *s, bool write)
 		flags |= ULOOP_READ;
 
 	buf = s->w.head;
-	if (write || (buf && s->w.data_bytes && !s->write_error))
+	if (write || (buf && s->w.data_bytes && !s->write_error &&
+	    !s->corked && !s->throttled))
 		flags |= ULOOP_WRITE;
 
 	uloop_fd_add(&sf->fd, flags);
@@ -55,6 +78,7 @@ static void ustream_fd_read_pending(struct ustream_fd *sf, bool *more)
 			break;
 
 		len = read(sf->fd.fd, buf, buflen);
+		ustream_stats_rx(s, len);
 		if (len < 0) {
 			if (errno == EINTR)
 				continue;
@@ -87,7 +111,11 @@ static int ustream_fd_write(struct ustream *s, const char *buf, int buflen, bool
 		return 0;
 
 	while (buflen) {
-		len = write(sf->fd.fd, buf, buflen);
+		if (sf->socket)
+			len = send(sf->fd.fd, buf, buflen, more ? MSG_MORE : 0);
+		else
+			len = write(sf->fd.fd, buf, buflen);
+		ustream_stats_tx(s, len);
 
 		if (len < 0) {
 			if (errno == EINTR)
@@ -110,13 +138,258 @@ static int ustream_fd_write(struct ustream *s, const char *buf, int buflen, bool
 	return ret;
 }
 
+static int ustream_fd_writev(struct ustream *s, const struct iovec *iov, int iovcnt, bool more)
+{
+	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	ssize_t len, buflen = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		buflen += iov[i].iov_len;
+
+	do {
+		if (sf->socket) {
+			struct msghdr msg = {
+				.msg_iov = (struct iovec *) iov,
+				.msg_iovlen = iovcnt,
+			};
+
+			len = sendmsg(sf->fd.fd, &msg, more ? MSG_MORE : 0);
+		} else {
+			len = writev(sf->fd.fd, iov, iovcnt);
+		}
+		ustream_stats_tx(s, len);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		len = 0;
+	}
+
+	if (len < buflen)
+		ustream_fd_set_uloop(s, true);
+
+	return len;
+}
+
+#ifdef __linux__
+static int ustream_fd_write_fd(struct ustream *s, int fd, off_t *offset, int len, bool more)
+{
+	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+	ssize_t ret = 0, cur;
+
+	if (more)
+		flags |= SPLICE_F_MORE;
+
+	while (len) {
+		if (offset)
+			cur = sendfile(sf->fd.fd, fd, offset, len);
+		else
+			cur = splice(fd, NULL, sf->fd.fd, NULL, len, flags);
+		ustream_stats_tx(s, cur);
+
+		if (cur < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			return -1;
+		}
+
+		/* source is truncated */
+		if (!cur)
+			return -1;
+
+		ret += cur;
+		len -= cur;
+	}
+
+	if (len)
+		ustream_fd_set_uloop(s, true);
+
+	return ret;
+}
+
+static void ustream_splice_put(struct ustream_splice *sp)
+{
+	if (--sp->refcount)
+		return;
+
+	close(sp->pipe[0]);
+	close(sp->pipe[1]);
+	free(sp);
+}
+
+/* len bytes have left the pipe, either sent or discarded by dst */
+static void ustream_splice_done(struct ustream_splice *sp, int len)
+{
+	struct ustream *s;
+
+	sp->pending -= len;
+	if (!sp->src)
+		return;
+
+	s = &sp->src->stream;
+	if (!(s->read_blocked & READ_BLOCKED_FULL))
+		return;
+
+	s->read_blocked &= ~READ_BLOCKED_FULL;
+	ustream_fd_set_uloop(s, false);
+}
+
+static void ustream_splice_sent(struct ustream_range *r, int len)
+{
+	ustream_splice_done(r->priv, len);
+}
+
+static void ustream_splice_release(struct ustream_range *r)
+{
+	struct ustream_splice *sp = r->priv;
+
+	ustream_splice_done(sp, r->len);
+	ustream_splice_put(sp);
+}
+
+static void ustream_fd_splice_pending(struct ustream_fd *sf, bool *more)
+{
+	struct ustream_splice *sp = sf->splice;
+	struct ustream *s = &sf->stream;
+	struct ustream_range r = {
+		.fd = sp->pipe[0],
+		.offset = -1,
+		.sent = ustream_splice_sent,
+		.release = ustream_splice_release,
+		.priv = sp,
+	};
+	ssize_t len;
+
+	do {
+		len = sp->size - sp->pending;
+		if (len <= 0) {
+			ustream_trace(s, USTREAM_TRACE_READ_FULL, sp->pending);
+			s->read_blocked |= READ_BLOCKED_FULL;
+			ustream_fd_set_uloop(s, false);
+			return;
+		}
+
+		len = splice(sf->fd.fd, NULL, sp->pipe[1], NULL, len,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		ustream_stats_rx(s, len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN)
+				return;
+
+			len = 0;
+		}
+
+		if (!len) {
+			if (!s->eof)
+				ustream_state_change(s);
+			s->eof = true;
+			ustream_fd_set_uloop(s, false);
+			return;
+		}
+
+		sp->refcount++;
+		sp->pending += len;
+		r.len = len;
+		if (ustream_write_range(sp->dst, &r, false) < len) {
+			/*
+			 * dst failed, the rest of the data is stuck in the pipe.
+			 * stop forwarding and let the owner of sf handle it
+			 */
+			ustream_fd_splice(sf, NULL);
+			ustream_state_change(s);
+			return;
+		}
+
+		*more = true;
+	} while (1);
+}
+
+int ustream_fd_splice(struct ustream_fd *sf, struct ustream *dst)
+{
+	struct ustream *s = &sf->stream;
+	struct ustream_splice *sp = sf->splice;
+	char *buf;
+	int len, wr;
+
+	if (sp) {
+		sf->splice = NULL;
+		sp->src = NULL;
+		ustream_splice_put(sp);
+		s->read_blocked &= ~READ_BLOCKED_FULL;
+	}
+
+	if (!dst)
+		goto out;
+
+	if (!dst->write_fd)
+		return -1;
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp)
+		return -1;
+
+	if (pipe2(sp->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		free(sp);
+		return -1;
+	}
+
+	sp->size = fcntl(sp->pipe[1], F_GETPIPE_SZ);
+	if (sp->size <= 0)
+		sp->size = 65536;
+
+	sp->src = sf;
+	sp->dst = dst;
+	sp->refcount = 1;
+	sf->splice = sp;
+
+	/* forward data that has already been received */
+	while ((buf = ustream_get_read_buf(s, &len)) != NULL) {
+		wr = ustream_write(dst, buf, len, false);
+		if (wr > 0)
+			ustream_consume(s, wr);
+
+		/* spliced data must not overtake the rest */
+		if (wr < len) {
+			ustream_fd_splice(sf, NULL);
+			return -1;
+		}
+	}
+
+out:
+	ustream_fd_set_uloop(s, false);
+	return 0;
+}
+#else
+int ustream_fd_splice(struct ustream_fd *sf, struct ustream *dst)
+{
+	return -1;
+}
+#endif
+
 static bool __ustream_fd_poll(struct ustream_fd *sf, unsigned int events)
 {
 	struct ustream *s = &sf->stream;
 	bool more = false;
 
-	if (events & ULOOP_READ)
-		ustream_fd_read_pending(sf, &more);
+	if (events & ULOOP_READ) {
+#ifdef __linux__
+		if (sf->splice)
+			ustream_fd_splice_pending(sf, &more);
+		else
+#endif
+			ustream_fd_read_pending(sf, &more);
+	}
 
 	if (events & ULOOP_WRITE) {
 		if (!ustream_write_pending(s))
@@ -144,19 +417,28 @@ static void ustream_fd_free(struct ustream *s)
 {
 	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
 
+	if (sf->splice)
+		ustream_fd_splice(sf, NULL);
+
 	uloop_fd_delete(&sf->fd);
 }
 
 void ustream_fd_init(struct ustream_fd *sf, int fd)
 {
 	struct ustream *s = &sf->stream;
+	struct stat st;
 
 	ustream_init_defaults(s);
 
 	sf->fd.fd = fd;
+	sf->socket = !fstat(fd, &st) && S_ISSOCK(st.st_mode);
 	sf->fd.cb = ustream_uloop_cb;
 	s->set_read_blocked = ustream_fd_set_read_blocked;
 	s->write = ustream_fd_write;
+	s->writev = ustream_fd_writev;
+#ifdef __linux__
+	s->write_fd = ustream_fd_write_fd;
+#endif
 	s->free = ustream_fd_free;
 	s->poll = ustream_fd_poll;
 	ustream_fd_set_uloop(s, false);
@@ -0,0 +1,198 @@
+/*
+ * ustream - library for stream buffer management
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ustream.h"
+
+#define USTREAM_MMAP_WINDOW	(64 * 1024 * 1024)
+#define USTREAM_MMAP_DROP	(1024 * 1024)
+
+/*
+ * drop the pages of consumed data, they are not going to be read again.
+ * min avoids a syscall for every small step of consumption
+ */
+static void ustream_mmap_drop(struct ustream_mmap *m, size_t min)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	size_t consumed;
+
+	if (!m->map)
+		return;
+
+	consumed = m->pos - m->stream.r.data_bytes;
+	consumed -= consumed % pagesize;
+	if (consumed <= m->dropped || consumed - m->dropped < min)
+		return;
+
+	madvise(m->map + m->dropped, consumed - m->dropped, MADV_DONTNEED);
+	m->dropped = consumed;
+}
+
+static void ustream_mmap_release(void *priv)
+{
+	ustream_mmap_drop(priv, 0);
+}
+
+static void ustream_mmap_consume(struct ustream *s)
+{
+	struct ustream_mmap *m = container_of(s, struct ustream_mmap, stream);
+
+	ustream_mmap_drop(m, USTREAM_MMAP_DROP);
+}
+
+static bool ustream_mmap_read_pending(struct ustream_mmap *m)
+{
+	struct ustream *s = &m->stream;
+	struct ustream_buf_list *l = &s->r;
+	struct ustream_buf *buf;
+	bool more = false;
+	int len;
+
+	while (!s->read_blocked && m->pos < m->size) {
+		if (l->max_buffers > 0 && l->buffers >= l->max_buffers) {
+			s->read_blocked |= READ_BLOCKED_FULL;
+			break;
+		}
+
+		buf = calloc(1, sizeof(*buf));
+		if (!buf)
+			break;
+
+		len = l->buffer_len;
+		if (len > m->size - m->pos)
+			len = m->size - m->pos;
+
+		buf->data = m->map + m->pos;
+		buf->tail = buf->end = buf->data + len;
+		buf->release = ustream_mmap_release;
+		buf->priv = m;
+
+		if (l->tail)
+			l->tail->next = buf;
+		else
+			l->head = buf;
+		l->tail = l->data_tail = buf;
+		l->buffers++;
+		l->data_bytes += len;
+		m->pos += len;
+
+		if (s->stats)
+			s->stats->rx_bytes += len;
+
+		if (m->pos == m->size) {
+			s->eof = true;
+			ustream_state_change(s);
+		}
+
+		if (s->notify_read)
+			s->notify_read(s, len);
+		more = true;
+	}
+
+	return more;
+}
+
+static void ustream_mmap_timer_cb(struct uloop_timeout *t)
+{
+	struct ustream_mmap *m = container_of(t, struct ustream_mmap, timer);
+
+	ustream_mmap_read_pending(m);
+}
+
+static void ustream_mmap_set_read_blocked(struct ustream *s)
+{
+	struct ustream_mmap *m = container_of(s, struct ustream_mmap, stream);
+
+	/* not called from here, the stream may be in use by the caller */
+	if (!s->read_blocked && m->pos < m->size)
+		uloop_timeout_set(&m->timer, 0);
+}
+
+static bool ustream_mmap_poll(struct ustream *s)
+{
+	struct ustream_mmap *m = container_of(s, struct ustream_mmap, stream);
+
+	return ustream_mmap_read_pending(m);
+}
+
+static int ustream_mmap_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	return -1;
+}
+
+static void ustream_mmap_free(struct ustream *s)
+{
+	struct ustream_mmap *m = container_of(s, struct ustream_mmap, stream);
+
+	uloop_timeout_cancel(&m->timer);
+	if (m->map)
+		munmap(m->map, m->size);
+	m->map = NULL;
+}
+
+int ustream_mmap_init(struct ustream_mmap *m, int fd)
+{
+	struct ustream *s = &m->stream;
+	struct stat st;
+	char *map = NULL;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			return -1;
+
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	m->map = map;
+	m->size = st.st_size;
+	m->pos = 0;
+	m->dropped = 0;
+
+	if (!s->r.buffer_len)
+		s->r.buffer_len = USTREAM_MMAP_WINDOW;
+	if (!s->r.max_buffers)
+		s->r.max_buffers = 2;
+
+	/* data is passed in place, it can't be 0-terminated */
+	s->string_data = false;
+	ustream_init_defaults(s);
+
+	m->timer.cb = ustream_mmap_timer_cb;
+	s->set_read_blocked = ustream_mmap_set_read_blocked;
+	s->write = ustream_mmap_write;
+	s->free = ustream_mmap_free;
+	s->poll = ustream_mmap_poll;
+	s->consume = ustream_mmap_consume;
+
+	if (!m->size) {
+		s->eof = true;
+		ustream_state_change(s);
+	} else {
+		uloop_timeout_set(&m->timer, 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,389 @@
+/*
+ * ustream - library for stream buffer management
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "ustream.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+
+/*
+ * Shared memory layout: one page holding the two ring headers, followed by
+ * the data of ring 0 and ring 1. Side 0 writes to ring 0 and reads from
+ * ring 1, side 1 the other way around.
+ * Each ring is mapped twice back to back, so that any range of pending
+ * data is contiguous and can be passed to the reader in place.
+ */
+struct ustream_shm_ring {
+	/* written by the producer */
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t closed;
+
+	/* written by the consumer */
+	uint32_t tail __attribute__((aligned(64)));
+
+	/* set by the side that waits for a wakeup through its eventfd */
+	uint32_t reader_waiting __attribute__((aligned(64)));
+	uint32_t writer_waiting;
+
+	uint32_t size;
+};
+
+static void ustream_shm_signal(struct ustream_shm *sh, uint32_t *waiting)
+{
+	uint64_t val = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_exchange_n(waiting, 0, __ATOMIC_ACQ_REL))
+		return;
+
+	if (write(sh->peer_fd, &val, sizeof(val)) < 0) {
+		/* counter overflow, the peer has been woken up anyway */
+	}
+}
+
+/* hand the space of all consumed data back to the peer */
+static void ustream_shm_publish(struct ustream_shm *sh)
+{
+	uint32_t tail = sh->rx_pos - sh->stream.r.data_bytes;
+
+	if (!sh->rx || sh->rx->tail == tail)
+		return;
+
+	__atomic_store_n(&sh->rx->tail, tail, __ATOMIC_RELEASE);
+	ustream_shm_signal(sh, &sh->rx->writer_waiting);
+}
+
+static void ustream_shm_release(void *priv)
+{
+	ustream_shm_publish(priv);
+}
+
+static void ustream_shm_read_pending(struct ustream_shm *sh, bool *more)
+{
+	struct ustream *s = &sh->stream;
+	struct ustream_buf_list *l = &s->r;
+	struct ustream_buf *buf;
+	uint32_t head;
+	int len;
+
+	if (s->eof || s->read_blocked)
+		return;
+
+	do {
+		head = __atomic_load_n(&sh->rx->head, __ATOMIC_ACQUIRE);
+		len = head - sh->rx_pos;
+		if (!len) {
+			/* about to go idle, ask for a wakeup and check again */
+			ustream_shm_publish(sh);
+			__atomic_store_n(&sh->rx->reader_waiting, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			head = __atomic_load_n(&sh->rx->head, __ATOMIC_ACQUIRE);
+			len = head - sh->rx_pos;
+			if (len)
+				__atomic_store_n(&sh->rx->reader_waiting, 0, __ATOMIC_RELAXED);
+		}
+
+		if (!len)
+			break;
+
+		/* all pending data is kept contiguous in a single buffer */
+		buf = l->tail;
+		if (!buf) {
+			buf = calloc(1, sizeof(*buf));
+			if (!buf)
+				return;
+
+			buf->data = buf->tail = sh->rx_data + sh->rx_pos % sh->size;
+			buf->release = ustream_shm_release;
+			buf->priv = sh;
+			l->head = l->tail = l->data_tail = buf;
+			l->buffers++;
+		} else if (buf->data >= sh->rx_data + sh->size) {
+			/*
+			 * partially consumed, move back to the first copy so
+			 * that the data stays within the double mapping
+			 */
+			buf->data -= sh->size;
+			buf->tail -= sh->size;
+		}
+
+		buf->tail += len;
+		buf->end = buf->tail;
+		l->data_bytes += len;
+		if (s->stats)
+			s->stats->rx_bytes += len;
+		sh->rx_pos = head;
+
+		if (s->notify_read)
+			s->notify_read(s, len);
+		*more = true;
+	} while (!s->read_blocked);
+
+	/*
+	 * nothing has been consumed from a full ring, get notified by
+	 * ustream_consume. partial consumption is published whenever the peer
+	 * wakes us up because it ran out of space.
+	 */
+	if (l->data_bytes >= sh->size) {
+		ustream_trace(s, USTREAM_TRACE_READ_FULL, l->data_bytes);
+		s->read_blocked |= READ_BLOCKED_FULL;
+	}
+
+	if (__atomic_load_n(&sh->rx->closed, __ATOMIC_ACQUIRE) &&
+	    sh->rx_pos == __atomic_load_n(&sh->rx->head, __ATOMIC_ACQUIRE)) {
+		if (!s->eof)
+			ustream_state_change(s);
+		s->eof = true;
+	}
+}
+
+static int ustream_shm_write(struct ustream *s, const char *buf, int buflen, bool more)
+{
+	struct ustream_shm *sh = container_of(s, struct ustream_shm, stream);
+	struct ustream_shm_ring *tx = sh->tx;
+	uint32_t head = tx->head;
+	int len, ret = 0;
+
+	if (__atomic_load_n(&sh->rx->closed, __ATOMIC_ACQUIRE))
+		return -1;
+
+	while (buflen) {
+		len = sh->size - (head - __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE));
+		if (!len) {
+			__atomic_store_n(&tx->writer_waiting, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			len = sh->size - (head - __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE));
+			if (!len) {
+				/* let the reader know that it holds up the ring */
+				uint64_t val = 1;
+
+				if (write(sh->peer_fd, &val, sizeof(val)) < 0) {
+					/* counter overflow */
+				}
+				break;
+			}
+
+			__atomic_store_n(&tx->writer_waiting, 0, __ATOMIC_RELAXED);
+		}
+
+		if (len > buflen)
+			len = buflen;
+
+		memcpy(sh->tx_data + head % sh->size, buf, len);
+		head += len;
+		buf += len;
+		buflen -= len;
+		ret += len;
+	}
+
+	if (ret) {
+		if (s->stats)
+			s->stats->tx_bytes += ret;
+		__atomic_store_n(&tx->head, head, __ATOMIC_RELEASE);
+		ustream_shm_signal(sh, &tx->reader_waiting);
+	}
+
+	return ret;
+}
+
+static void ustream_shm_set_read_blocked(struct ustream *s)
+{
+	struct ustream_shm *sh = container_of(s, struct ustream_shm, stream);
+	bool more;
+
+	ustream_shm_publish(sh);
+	if (!s->read_blocked)
+		ustream_shm_read_pending(sh, &more);
+}
+
+static bool ustream_shm_poll(struct ustream *s)
+{
+	struct ustream_shm *sh = container_of(s, struct ustream_shm, stream);
+	bool more = false;
+
+	ustream_shm_publish(sh);
+	ustream_shm_read_pending(sh, &more);
+	if (s->w.data_bytes)
+		ustream_write_pending(s);
+
+	return more;
+}
+
+static void ustream_shm_uloop_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct ustream_shm *sh = container_of(fd, struct ustream_shm, fd);
+	uint64_t val;
+
+	while (read(fd->fd, &val, sizeof(val)) < 0 && errno == EINTR)
+		;
+
+	ustream_shm_poll(&sh->stream);
+}
+
+static void *ustream_shm_map_ring(int fd, off_t offset, int size)
+{
+	char *map;
+
+	map = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (mmap(map, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED ||
+	    mmap(map + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+		munmap(map, 2 * size);
+		return NULL;
+	}
+
+	return map;
+}
+
+static void ustream_shm_unmap(struct ustream_shm *sh)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct ustream_shm_ring *hdr = sh->tx < sh->rx ? sh->tx : sh->rx;
+
+	if (sh->tx_data)
+		munmap(sh->tx_data, 2 * sh->size);
+	if (sh->rx_data)
+		munmap(sh->rx_data, 2 * sh->size);
+	if (hdr)
+		munmap(hdr, pagesize);
+
+	sh->rx = sh->tx = NULL;
+	sh->rx_data = sh->tx_data = NULL;
+}
+
+static void ustream_shm_free(struct ustream *s)
+{
+	struct ustream_shm *sh = container_of(s, struct ustream_shm, stream);
+	uint64_t val = 1;
+
+	uloop_fd_delete(&sh->fd);
+
+	__atomic_store_n(&sh->tx->closed, 1, __ATOMIC_RELEASE);
+	if (write(sh->peer_fd, &val, sizeof(val)) < 0) {
+		/* peer is already gone */
+	}
+
+	ustream_shm_unmap(sh);
+}
+
+int ustream_shm_create(int size, int fds[3])
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct ustream_shm_ring *hdr;
+	int i;
+
+	size = (size + pagesize - 1) & ~(pagesize - 1);
+	if (size <= 0)
+		return -1;
+
+	fds[0] = memfd_create("ustream-shm", MFD_CLOEXEC);
+	if (fds[0] < 0)
+		return -1;
+
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[1] < 0 || fds[2] < 0)
+		goto error;
+
+	if (ftruncate(fds[0], pagesize + 2 * size) < 0)
+		goto error;
+
+	hdr = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (hdr == MAP_FAILED)
+		goto error;
+
+	for (i = 0; i < 2; i++) {
+		hdr[i].size = size;
+		hdr[i].reader_waiting = 1;
+	}
+	munmap(hdr, pagesize);
+
+	return 0;
+
+error:
+	for (i = 0; i < 3; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	return -1;
+}
+
+int ustream_shm_init(struct ustream_shm *sh, int fds[3], int side)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct ustream *s = &sh->stream;
+	struct ustream_shm_ring *hdr;
+	uint64_t val = 1;
+
+	hdr = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (hdr == MAP_FAILED)
+		return -1;
+
+	side = !!side;
+	sh->size = hdr[0].size;
+	sh->tx = &hdr[side];
+	sh->rx = &hdr[!side];
+	sh->tx_data = ustream_shm_map_ring(fds[0], pagesize + side * sh->size, sh->size);
+	sh->rx_data = ustream_shm_map_ring(fds[0], pagesize + !side * sh->size, sh->size);
+	if (!sh->tx_data || !sh->rx_data) {
+		ustream_shm_unmap(sh);
+		return -1;
+	}
+
+	sh->rx_pos = sh->rx->tail;
+
+	/* pending data is passed in place, it can't be 0-terminated */
+	s->string_data = false;
+	ustream_init_defaults(s);
+
+	sh->fd.fd = fds[1 + side];
+	sh->fd.cb = ustream_shm_uloop_cb;
+	sh->peer_fd = fds[2 - side];
+	s->set_read_blocked = ustream_shm_set_read_blocked;
+	s->write = ustream_shm_write;
+	s->free = ustream_shm_free;
+	s->poll = ustream_shm_poll;
+	uloop_fd_add(&sh->fd, ULOOP_READ);
+
+	/* pick up data that was sent before this side was set up */
+	if (write(sh->fd.fd, &val, sizeof(val)) < 0) {
+		/* a wakeup is already pending */
+	}
+
+	return 0;
+}
+#else
+int ustream_shm_create(int size, int fds[3])
+{
+	return -1;
+}
+
+int ustream_shm_init(struct ustream_shm *sh, int fds[3], int side)
+{
+	return -1;
+}
+#endif
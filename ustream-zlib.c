@@ -0,0 +1,261 @@
+/*
+ * ustream - library for stream buffer management
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include "ustream-zlib.h"
+
+#define USTREAM_ZLIB_CHUNK	16384
+#define USTREAM_ZLIB_PENDING	65536
+
+static struct ustream_zlib *ustream_zlib_get(struct ustream *lower)
+{
+	return container_of(lower->upper, struct ustream_zlib, stream);
+}
+
+static void ustream_zlib_eof(struct ustream_zlib *z)
+{
+	struct ustream *s = &z->stream;
+
+	ustream_set_read_blocked(z->lower, true);
+	if (s->eof)
+		return;
+
+	s->eof = true;
+	ustream_state_change(s);
+}
+
+static void ustream_zlib_read(struct ustream_zlib *z)
+{
+	struct ustream *s = &z->stream, *lower = z->lower;
+	z_stream *rx = &z->rx;
+	char *in, *out;
+	int in_len, out_len, ret;
+
+	if (s->eof)
+		return;
+
+	while (!s->read_blocked &&
+	       (in = ustream_get_read_buf(lower, &in_len)) != NULL) {
+		out = ustream_reserve(s, 1, &out_len);
+		if (!out)
+			break;
+
+		rx->next_in = (Bytef *) in;
+		rx->avail_in = in_len;
+		rx->next_out = (Bytef *) out;
+		rx->avail_out = out_len;
+
+		ret = inflate(rx, Z_SYNC_FLUSH);
+		if (ret == Z_STREAM_END) {
+			inflateReset(rx);
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			ustream_zlib_eof(z);
+			return;
+		}
+
+		ustream_consume(lower, in_len - rx->avail_in);
+		if (out_len > rx->avail_out)
+			ustream_fill_read(s, out_len - rx->avail_out);
+	}
+
+	if (lower->eof && !lower->r.data_bytes) {
+		ustream_zlib_eof(z);
+		return;
+	}
+
+	ustream_set_read_blocked(lower, !!s->read_blocked);
+}
+
+static int ustream_zlib_deflate(struct ustream_zlib *z, const char *buf, int len, int flush)
+{
+	struct ustream *lower = z->lower;
+	z_stream *tx = &z->tx;
+	char out[USTREAM_ZLIB_CHUNK];
+	int n;
+
+	tx->next_in = (Bytef *) buf;
+	tx->avail_in = len;
+	do {
+		tx->next_out = (Bytef *) out;
+		tx->avail_out = sizeof(out);
+		if (deflate(tx, flush) == Z_STREAM_ERROR)
+			return -1;
+
+		n = sizeof(out) - tx->avail_out;
+		if (n && ustream_write(lower, out, n,
+				       !tx->avail_out || flush == Z_NO_FLUSH) < n)
+			return -1;
+	} while (!tx->avail_out);
+
+	z->tx_pending = flush == Z_NO_FLUSH;
+	return 0;
+}
+
+static void ustream_zlib_flush_cb(struct uloop_timeout *t)
+{
+	struct ustream_zlib *z = container_of(t, struct ustream_zlib, flush);
+
+	if (z->tx_pending)
+		ustream_zlib_deflate(z, NULL, 0, Z_SYNC_FLUSH);
+}
+
+static void ustream_zlib_kick_cb(struct uloop_timeout *t)
+{
+	struct ustream_zlib *z = container_of(t, struct ustream_zlib, kick);
+
+	ustream_zlib_read(z);
+}
+
+static int ustream_zlib_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct ustream_zlib *z = container_of(s, struct ustream_zlib, stream);
+
+	if (z->lower->write_error)
+		return -1;
+
+	if (z->lower->w.data_bytes >= USTREAM_ZLIB_PENDING)
+		return 0;
+
+	if (ustream_zlib_deflate(z, buf, len, more ? Z_NO_FLUSH : Z_SYNC_FLUSH) < 0)
+		return -1;
+
+	/* data held back for compressing it with the next write */
+	if (z->tx_pending && !z->flush.pending)
+		uloop_timeout_set(&z->flush, 0);
+	else if (!z->tx_pending)
+		uloop_timeout_cancel(&z->flush);
+
+	return len;
+}
+
+static void ustream_zlib_set_read_blocked(struct ustream *s)
+{
+	struct ustream_zlib *z = container_of(s, struct ustream_zlib, stream);
+
+	/* not called from here, the stream may be in use by the caller */
+	if (!s->read_blocked)
+		uloop_timeout_set(&z->kick, 0);
+	else
+		ustream_set_read_blocked(z->lower, true);
+}
+
+static bool ustream_zlib_poll(struct ustream *s)
+{
+	struct ustream_zlib *z = container_of(s, struct ustream_zlib, stream);
+
+	if (!z->lower->poll)
+		return false;
+
+	return z->lower->poll(z->lower);
+}
+
+static void ustream_zlib_free(struct ustream *s)
+{
+	struct ustream_zlib *z = container_of(s, struct ustream_zlib, stream);
+	struct ustream *lower = z->lower;
+	struct ustream_buf *buf;
+
+	/*
+	 * data held back while lower was busy would be discarded along with
+	 * the write buffers, hand it to lower regardless of its queue length
+	 */
+	for (buf = s->w.head; buf && !lower->write_error; buf = buf->next) {
+		if (buf->tail == buf->data)
+			continue;
+
+		if (ustream_zlib_deflate(z, buf->data, buf->tail - buf->data,
+					 Z_NO_FLUSH) < 0)
+			break;
+	}
+
+	if (z->tx_pending && !lower->write_error)
+		ustream_zlib_deflate(z, NULL, 0, Z_SYNC_FLUSH);
+
+	uloop_timeout_cancel(&z->kick);
+	uloop_timeout_cancel(&z->flush);
+	deflateEnd(&z->tx);
+	inflateEnd(&z->rx);
+
+	lower->upper = NULL;
+	lower->notify_read = NULL;
+	lower->notify_write = NULL;
+	lower->notify_state = NULL;
+}
+
+static void ustream_zlib_notify_read(struct ustream *lower, int bytes)
+{
+	ustream_zlib_read(ustream_zlib_get(lower));
+}
+
+static void ustream_zlib_notify_write(struct ustream *lower, int bytes)
+{
+	struct ustream_zlib *z = ustream_zlib_get(lower);
+
+	if (z->stream.w.data_bytes)
+		ustream_write_pending(&z->stream);
+}
+
+static void ustream_zlib_notify_state(struct ustream *lower)
+{
+	struct ustream_zlib *z = ustream_zlib_get(lower);
+	struct ustream *s = &z->stream;
+
+	if (lower->write_error && !s->write_error) {
+		s->write_error = true;
+		ustream_state_change(s);
+	}
+
+	if (lower->eof)
+		ustream_zlib_read(z);
+}
+
+int ustream_zlib_init(struct ustream_zlib *z, struct ustream *lower, int level)
+{
+	struct ustream *s = &z->stream;
+
+	memset(&z->rx, 0, sizeof(z->rx));
+	memset(&z->tx, 0, sizeof(z->tx));
+	if (deflateInit(&z->tx, level) != Z_OK)
+		return -1;
+
+	if (inflateInit(&z->rx) != Z_OK) {
+		deflateEnd(&z->tx);
+		return -1;
+	}
+
+	ustream_init_defaults(s);
+
+	z->lower = lower;
+	z->tx_pending = false;
+	z->kick.cb = ustream_zlib_kick_cb;
+	z->flush.cb = ustream_zlib_flush_cb;
+	s->write = ustream_zlib_write;
+	s->set_read_blocked = ustream_zlib_set_read_blocked;
+	s->poll = ustream_zlib_poll;
+	s->free = ustream_zlib_free;
+
+	lower->upper = s;
+	lower->notify_read = ustream_zlib_notify_read;
+	lower->notify_write = ustream_zlib_notify_write;
+	lower->notify_state = ustream_zlib_notify_state;
+
+	/* pick up data that has already been received */
+	uloop_timeout_set(&z->kick, 0);
+
+	return 0;
+}
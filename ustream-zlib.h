@@ -0,0 +1,53 @@
+/*
+ * ustream - library for stream buffer management
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __USTREAM_ZLIB_H
+#define __USTREAM_ZLIB_H
+
+#include <zlib.h>
+#include "ustream.h"
+
+struct ustream_zlib {
+	struct ustream stream;
+	struct ustream *lower;
+
+	struct uloop_timeout kick;
+	struct uloop_timeout flush;
+
+	z_stream rx, tx;
+	bool tx_pending;
+};
+
+/*
+ * ustream_zlib_init: create a ustream that compresses all data written to
+ * it and decompresses all data received, using lower as transport
+ *
+ * level is the deflate level from 1 (fastest) to 9 (best compression),
+ * 0 stores the data uncompressed, Z_DEFAULT_COMPRESSION uses level 6.
+ * writes with more set are compressed together, everything else is
+ * flushed right away. reading from lower is blocked while the read buffers
+ * are full, writing is held back while more than 64k of compressed data
+ * are queued on lower. eof and write errors of lower are passed on,
+ * invalid compressed data is treated as eof.
+ * takes over the notify callbacks of lower, which is not freed by
+ * ustream_free. data still queued is compressed and written to lower by
+ * ustream_free, lower needs to stay around until it has been sent.
+ * returns 0 on success, -1 on error
+ */
+int ustream_zlib_init(struct ustream_zlib *z, struct ustream *lower, int level);
+
+#endif
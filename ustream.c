@@ -16,14 +16,78 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include "ustream.h"
 
+#define USTREAM_IOV_MAX	16
+
+#define USTREAM_ADAPTIVE_MAX_LEN	65536
+#define USTREAM_ADAPTIVE_MAX_BUFFERS	8
+#define USTREAM_ADAPTIVE_IDLE		1000
+
+#define USTREAM_FORWARD_PENDING	65536
+
+struct ustream_adaptive_stats ustream_adaptive_stats;
+
+static LIST_HEAD(ustreams);
+
+static struct {
+	size_t used;
+	size_t high;
+	size_t low;
+	bool blocked;
+
+	void (*notify)(bool blocked);
+} ustream_mem;
+
+static void __ustream_set_read_blocked(struct ustream *s, unsigned char val);
+
+void ustream_trace(struct ustream *s, enum ustream_trace_event ev, int val)
+{
+	struct ustream_stats *st = s->stats;
+
+	if (!st)
+		return;
+
+	switch (ev) {
+	case USTREAM_TRACE_ALLOC:
+		st->allocs++;
+		break;
+	case USTREAM_TRACE_READ_FULL:
+		st->read_full++;
+		break;
+	case USTREAM_TRACE_WRITE_ERROR:
+		st->write_errors++;
+		break;
+	}
+
+	if (st->trace)
+		st->trace(s, ev, val);
+}
+
+static void ustream_w_stats(struct ustream *s)
+{
+	struct ustream_stats *st = s->stats;
+
+	if (!st)
+		return;
+
+	if (st->max_w_bytes < s->w.data_bytes)
+		st->max_w_bytes = s->w.data_bytes;
+	if (st->max_w_buffers < s->w.buffers)
+		st->max_w_buffers = s->w.buffers;
+}
+
 static void ustream_init_buf(struct ustream_buf *buf, int len)
 {
 	if (!len)
@@ -57,6 +121,54 @@ static bool ustream_can_alloc(struct ustream_buf_list *l)
 	return (l->buffers < l->max_buffers);
 }
 
+static void ustream_mem_set_blocked(bool blocked)
+{
+	struct ustream *s;
+
+	ustream_mem.blocked = blocked;
+	list_for_each_entry(s, &ustreams, list) {
+		unsigned char val = s->read_blocked & ~READ_BLOCKED_MEM;
+
+		if (blocked)
+			val |= READ_BLOCKED_MEM;
+
+		__ustream_set_read_blocked(s, val);
+	}
+
+	if (ustream_mem.notify)
+		ustream_mem.notify(blocked);
+}
+
+static void ustream_mem_update(int delta)
+{
+	ustream_mem.used += delta;
+
+	if (!ustream_mem.high)
+		return;
+
+	if (!ustream_mem.blocked && ustream_mem.used > ustream_mem.high)
+		ustream_mem_set_blocked(true);
+	else if (ustream_mem.blocked && ustream_mem.used <= ustream_mem.low)
+		ustream_mem_set_blocked(false);
+}
+
+void ustream_set_mem_limit(size_t high, size_t low, void (*notify)(bool blocked))
+{
+	ustream_mem.high = high;
+	ustream_mem.low = low < high ? low : high;
+	ustream_mem.notify = notify;
+
+	if (ustream_mem.blocked && (!high || ustream_mem.used <= ustream_mem.low))
+		ustream_mem_set_blocked(false);
+	else
+		ustream_mem_update(0);
+}
+
+size_t ustream_mem_usage(void)
+{
+	return ustream_mem.used;
+}
+
 static int ustream_alloc_default(struct ustream *s, struct ustream_buf_list *l)
 {
 	struct ustream_buf *buf;
@@ -67,33 +179,171 @@ static int ustream_alloc_default(struct ustream *s, struct ustream_buf_list *l)
 	buf = malloc(sizeof(*buf) + l->buffer_len + s->string_data);
 	ustream_init_buf(buf, l->buffer_len);
 	ustream_add_buf(l, buf);
+	ustream_trace(s, USTREAM_TRACE_ALLOC, l->buffer_len);
+
+	if (l == &s->w)
+		ustream_mem_update(l->buffer_len);
+
+	return 0;
+}
+
+#ifdef __linux__
+/*
+ * The ring is mapped twice back to back, preceded by one page of anonymous
+ * memory holding the struct ustream_buf, so that buf->head is the start of
+ * the ring. One byte is kept free to allow 0-termination of string data.
+ */
+static int ustream_alloc_ring(struct ustream *s, struct ustream_buf_list *l)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int len = l->buffer_len;
+	struct ustream_buf *buf;
+	char *map, *ring;
+	int fd;
+
+	if (!ustream_can_alloc(l))
+		return -1;
+
+	fd = memfd_create("ustream", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, len) < 0)
+		goto error;
+
+	map = mmap(NULL, pagesize + 2 * len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		goto error;
+
+	ring = map + pagesize;
+	if (mmap(ring, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(ring + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(map, pagesize + 2 * len);
+		goto error;
+	}
+	close(fd);
+
+	l->ring_map_len = pagesize + 2 * len;
+	buf = (struct ustream_buf *) (ring - offsetof(struct ustream_buf, head));
+	ustream_init_buf(buf, len - 1);
+	ustream_add_buf(l, buf);
+	ustream_trace(s, USTREAM_TRACE_ALLOC, len);
 
 	return 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+int ustream_set_read_ring(struct ustream *s, int len)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct ustream_buf_list *l = &s->r;
+
+	/* the ring size is fixed, adaptive sizing would change it */
+	if (l->head || l->ring || s->adaptive.enabled)
+		return -1;
+
+	len = (len + pagesize - 1) & ~(pagesize - 1);
+	if (len <= 0)
+		return -1;
+
+	l->ring = true;
+	l->alloc = ustream_alloc_ring;
+	l->min_buffers = 1;
+	l->max_buffers = 1;
+	l->buffer_len = len;
+
+	if (ustream_alloc_ring(s, l) < 0) {
+		l->ring = false;
+		l->alloc = ustream_alloc_default;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ustream_free_ring(struct ustream_buf_list *l)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (l->head)
+		munmap(l->head->head - pagesize, l->ring_map_len);
+	l->head = NULL;
+	l->tail = NULL;
+	l->data_tail = NULL;
+	l->buffers = 0;
+}
+#else
+int ustream_set_read_ring(struct ustream *s, int len)
+{
+	return -1;
+}
+
+static void ustream_free_ring(struct ustream_buf_list *l)
+{
+}
+#endif
+
+static void ustream_release_buf(struct ustream *s, struct ustream_buf_list *l,
+			       struct ustream_buf *buf)
+{
+	if (buf->range) {
+		if (buf->range->release)
+			buf->range->release(buf->range);
+	} else if (buf->release) {
+		buf->release(buf->priv);
+	} else if (l == &s->w) {
+		ustream_mem_update(-(buf->end - buf->head));
+	}
+
+	free(buf);
 }
 
-static void ustream_free_buffers(struct ustream_buf_list *l)
+static void ustream_free_buffers(struct ustream *s, struct ustream_buf_list *l)
 {
 	struct ustream_buf *buf = l->head;
 
+	if (l->ring) {
+		ustream_free_ring(l);
+		return;
+	}
+
 	while (buf) {
 		struct ustream_buf *next = buf->next;
 
-		free(buf);
+		ustream_release_buf(s, l, buf);
 		buf = next;
 	}
 	l->head = NULL;
 	l->tail = NULL;
 	l->data_tail = NULL;
+	l->buffers = 0;
 }
 
 void ustream_free(struct ustream *s)
 {
+	if (s->fwd_read)
+		ustream_forward_stop(s->fwd_read);
+	if (s->fwd_write)
+		ustream_forward_stop(s->fwd_write);
+
+	if (s->list.next)
+		list_del(&s->list);
+
 	if (s->free)
 		s->free(s);
 
+	if (s->adaptive.enabled)
+		ustream_set_adaptive(s, false);
+
 	uloop_timeout_cancel(&s->state_change);
-	ustream_free_buffers(&s->r);
-	ustream_free_buffers(&s->w);
+	uloop_timeout_cancel(&s->cork_timer);
+	uloop_timeout_cancel(&s->rate_timer);
+	ustream_free_buffers(s, &s->r);
+	ustream_free_buffers(s, &s->w);
 }
 
 static void ustream_state_change_cb(struct uloop_timeout *t)
@@ -101,11 +351,119 @@ static void ustream_state_change_cb(struct uloop_timeout *t)
 	struct ustream *s = container_of(t, struct ustream, state_change);
 
 	if (s->write_error)
-		ustream_free_buffers(&s->w);
+		ustream_free_buffers(s, &s->w);
 	if (s->notify_state)
 		s->notify_state(s);
 }
 
+static void ustream_cork_timer_cb(struct uloop_timeout *t)
+{
+	struct ustream *s = container_of(t, struct ustream, cork_timer);
+
+	ustream_uncork(s);
+}
+
+static long long ustream_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void ustream_ratelimit_init(struct ustream_ratelimit *rl, unsigned int rate,
+			    unsigned int burst)
+{
+	if (!rate)
+		rate = 1;
+
+	if (!burst)
+		burst = rate / 10;
+
+	if (!burst)
+		burst = 1;
+
+	rl->rate = rate;
+	rl->burst = burst;
+	rl->tokens = burst;
+	rl->last = ustream_time_us();
+}
+
+static void ustream_ratelimit_refill(struct ustream_ratelimit *rl)
+{
+	long long now = ustream_time_us();
+	long long add = (now - rl->last) * rl->rate / 1000000;
+
+	if (rl->tokens + add >= rl->burst) {
+		rl->tokens = rl->burst;
+		rl->last = now;
+		return;
+	}
+
+	if (add <= 0)
+		return;
+
+	/* keep the remainder for the next refill */
+	rl->tokens += add;
+	rl->last += add * 1000000 / rl->rate;
+}
+
+/*
+ * returns true if the bucket is empty. the timer is armed for the time
+ * when a quarter of the bucket has been refilled, to avoid lots of tiny
+ * reads and writes
+ */
+static bool ustream_ratelimit_wait(struct ustream *s, struct ustream_ratelimit *rl)
+{
+	long long need;
+	int timeout;
+
+	ustream_ratelimit_refill(rl);
+	if (rl->tokens > 0)
+		return false;
+
+	need = rl->burst / 4 - rl->tokens;
+	if (need < 1)
+		need = 1;
+
+	timeout = need * 1000 / rl->rate + 1;
+	if (!s->rate_timer.pending ||
+	    uloop_timeout_remaining(&s->rate_timer) > timeout)
+		uloop_timeout_set(&s->rate_timer, timeout);
+
+	return true;
+}
+
+static void ustream_rate_timer_cb(struct uloop_timeout *t)
+{
+	struct ustream *s = container_of(t, struct ustream, rate_timer);
+
+	if ((s->read_blocked & READ_BLOCKED_RATE) &&
+	    (!s->rx_limit || !ustream_ratelimit_wait(s, s->rx_limit)))
+		__ustream_set_read_blocked(s, s->read_blocked & ~READ_BLOCKED_RATE);
+
+	if (s->w.data_bytes)
+		ustream_write_pending(s);
+}
+
+void ustream_set_ratelimit(struct ustream *s, struct ustream_ratelimit *rx,
+			   struct ustream_ratelimit *tx)
+{
+	s->rx_limit = rx;
+	s->tx_limit = tx;
+
+	uloop_timeout_cancel(&s->rate_timer);
+	ustream_rate_timer_cb(&s->rate_timer);
+}
+
+void ustream_for_each(void (*cb)(struct ustream *s, void *priv), void *priv)
+{
+	struct ustream *s, *tmp;
+
+	list_for_each_entry_safe(s, tmp, &ustreams, list)
+		cb(s, priv);
+}
+
 void ustream_init_defaults(struct ustream *s)
 {
 #define DEFAULT_SET(_f, _default)	\
@@ -128,10 +486,17 @@ void ustream_init_defaults(struct ustream *s)
 #undef DEFAULT_SET
 
 	s->state_change.cb = ustream_state_change_cb;
+	s->cork_timer.cb = ustream_cork_timer_cb;
+	s->rate_timer.cb = ustream_rate_timer_cb;
+	s->corked = false;
+	s->throttled = false;
 	s->write_error = false;
 	s->eof = false;
 	s->eof_write_done = false;
-	s->read_blocked = 0;
+	s->read_blocked = ustream_mem.blocked ? READ_BLOCKED_MEM : 0;
+
+	if (!s->list.next)
+		list_add_tail(&s->list, &ustreams);
 
 	s->r.buffers = 0;
 	s->r.data_bytes = 0;
@@ -145,7 +510,7 @@ static bool ustream_should_move(struct ustream_buf_list *l, struct ustream_buf *
 	int maxlen;
 	int offset;
 
-	if (buf->data == buf->head)
+	if (buf->data == buf->head || buf->release || l->ring)
 		return false;
 
 	maxlen = buf->end - buf->head;
@@ -163,8 +528,14 @@ static bool ustream_should_move(struct ustream_buf_list *l, struct ustream_buf *
 	return (buf->end - buf->tail < len);
 }
 
-static void ustream_free_buf(struct ustream_buf_list *l, struct ustream_buf *buf)
+static void ustream_free_buf(struct ustream *s, struct ustream_buf_list *l,
+			    struct ustream_buf *buf)
 {
+	if (l->ring) {
+		ustream_init_buf(buf, l->buffer_len - 1);
+		return;
+	}
+
 	if (buf == l->head)
 		l->head = buf->next;
 
@@ -174,8 +545,10 @@ static void ustream_free_buf(struct ustream_buf_list *l, struct ustream_buf *buf
 	if (buf == l->tail)
 		l->tail = NULL;
 
-	if (--l->buffers >= l->min_buffers) {
-		free(buf);
+	if (--l->buffers >= l->min_buffers || buf->range || buf->release ||
+	    buf->end - buf->head != l->buffer_len ||
+	    (l == &s->w && s->packet)) {
+		ustream_release_buf(s, l, buf);
 		return;
 	}
 
@@ -203,6 +576,134 @@ void ustream_set_read_blocked(struct ustream *s, bool set)
 	__ustream_set_read_blocked(s, val);
 }
 
+static void ustream_ring_advance(struct ustream_buf_list *l, struct ustream_buf *buf)
+{
+	if (buf->data >= buf->head + l->buffer_len) {
+		buf->data -= l->buffer_len;
+		buf->tail -= l->buffer_len;
+	}
+	buf->end = buf->data + l->buffer_len - 1;
+}
+
+/* the read buffers may not have been set up yet in ustream_set_adaptive */
+static void ustream_adaptive_setup(struct ustream *s)
+{
+	if (!s->adaptive.min_len)
+		s->adaptive.min_len = s->r.buffer_len;
+	if (!s->adaptive.max_buffers)
+		s->adaptive.max_buffers = s->r.max_buffers;
+}
+
+/* called when the read buffers are full */
+static bool ustream_adaptive_grow(struct ustream *s)
+{
+	struct ustream_buf_list *l = &s->r;
+
+	if (!s->adaptive.enabled || l->ring || l->max_buffers <= 0 ||
+	    l->max_buffers >= USTREAM_ADAPTIVE_MAX_BUFFERS)
+		return false;
+
+	ustream_adaptive_setup(s);
+	l->max_buffers++;
+	if (l->buffer_len < USTREAM_ADAPTIVE_MAX_LEN)
+		l->buffer_len *= 2;
+
+	s->adaptive.grow++;
+	ustream_adaptive_stats.grow++;
+	return true;
+}
+
+/*
+ * called when no read data has been consumed for USTREAM_ADAPTIVE_IDLE ms:
+ * release the read buffers and scale down if the bursts of data since the
+ * last release used only a small part of them
+ */
+static void ustream_adaptive_idle(struct uloop_timeout *t)
+{
+	struct ustream *s = container_of(t, struct ustream, adaptive.idle);
+	struct ustream_buf_list *l = &s->r;
+	struct ustream_adaptive *a = &s->adaptive;
+
+	ustream_adaptive_setup(s);
+
+	/* still busy, check again later */
+	if (a->active) {
+		a->active = false;
+		uloop_timeout_set(t, USTREAM_ADAPTIVE_IDLE);
+		return;
+	}
+
+	/* unconsumed data, the timer is armed again once it is drained */
+	if (l->data_bytes || l->ring)
+		return;
+
+	if (a->min_len > 0 && !a->peak &&
+	    (l->buffer_len != a->min_len || l->max_buffers != a->max_buffers)) {
+		/* nothing received since the last release */
+		l->buffer_len = a->min_len;
+		l->max_buffers = a->max_buffers;
+		a->shrink++;
+		ustream_adaptive_stats.shrink++;
+	} else if (a->peak < l->buffer_len / 4 && a->min_len > 0 &&
+		   l->buffer_len / 2 >= a->min_len) {
+		l->buffer_len /= 2;
+		if (l->max_buffers > a->max_buffers)
+			l->max_buffers--;
+
+		a->shrink++;
+		ustream_adaptive_stats.shrink++;
+	}
+
+	a->peak = 0;
+	ustream_free_buffers(s, l);
+
+	/* keep checking while the stream stays idle */
+	if (l->buffer_len != a->min_len || l->max_buffers != a->max_buffers)
+		uloop_timeout_set(t, USTREAM_ADAPTIVE_IDLE);
+}
+
+/*
+ * called when all read data has been consumed. the buffers are kept for
+ * further reads, they are only released once the stream has been idle
+ * for a while
+ */
+static void ustream_adaptive_drained(struct ustream *s)
+{
+	struct ustream_adaptive *a = &s->adaptive;
+
+	if (a->burst > a->peak)
+		a->peak = a->burst;
+	a->burst = 0;
+
+	if (a->idle.pending) {
+		a->active = true;
+		return;
+	}
+
+	a->active = false;
+	uloop_timeout_set(&a->idle, USTREAM_ADAPTIVE_IDLE);
+}
+
+void ustream_set_adaptive(struct ustream *s, bool enable)
+{
+	if (s->adaptive.enabled == enable || s->r.ring)
+		return;
+
+	s->adaptive.enabled = enable;
+	if (!enable) {
+		uloop_timeout_cancel(&s->adaptive.idle);
+		ustream_adaptive_stats.streams--;
+		return;
+	}
+
+	ustream_adaptive_stats.streams++;
+	s->adaptive.min_len = s->r.buffer_len;
+	s->adaptive.max_buffers = s->r.max_buffers;
+	s->adaptive.burst = 0;
+	s->adaptive.peak = 0;
+	s->adaptive.idle.cb = ustream_adaptive_idle;
+}
+
 void ustream_consume(struct ustream *s, int len)
 {
 	struct ustream_buf *buf = s->r.head;
@@ -220,14 +721,22 @@ void ustream_consume(struct ustream *s, int len)
 
 		if (len < buf_len) {
 			buf->data += len;
+			if (s->r.ring)
+				ustream_ring_advance(&s->r, buf);
 			break;
 		}
 
 		len -= buf_len;
-		ustream_free_buf(&s->r, buf);
+		ustream_free_buf(s, &s->r, buf);
 		buf = next;
 	} while(len);
 
+	if (!s->r.data_bytes && s->adaptive.enabled)
+		ustream_adaptive_drained(s);
+
+	if (s->consume)
+		s->consume(s);
+
 	__ustream_set_read_blocked(s, s->read_blocked & ~READ_BLOCKED_FULL);
 }
 
@@ -251,6 +760,8 @@ static bool ustream_prepare_buf(struct ustream *s, struct ustream_buf_list *l, i
 			memmove(buf->head, buf->data, len);
 			buf->data = buf->head;
 			buf->tail = buf->data + len;
+			if (s->stats)
+				s->stats->moved += len;
 
 			if (l == &s->r)
 				ustream_fixup_string(s, buf);
@@ -278,7 +789,15 @@ char *ustream_reserve(struct ustream *s, int len, int *maxlen)
 {
 	struct ustream_buf *buf = s->r.head;
 
-	if (!ustream_prepare_buf(s, &s->r, len)) {
+	if (s->read_blocked & READ_BLOCKED_RATE) {
+		*maxlen = 0;
+		return NULL;
+	}
+
+	if (!ustream_prepare_buf(s, &s->r, len) &&
+	    (!ustream_adaptive_grow(s) || !ustream_prepare_buf(s, &s->r, len))) {
+		if (!(s->read_blocked & READ_BLOCKED_FULL))
+			ustream_trace(s, USTREAM_TRACE_READ_FULL, s->r.data_bytes);
 		__ustream_set_read_blocked(s, s->read_blocked | READ_BLOCKED_FULL);
 		*maxlen = 0;
 		return NULL;
@@ -286,6 +805,15 @@ char *ustream_reserve(struct ustream *s, int len, int *maxlen)
 
 	buf = s->r.data_tail;
 	*maxlen = buf->end - buf->tail;
+
+	if (s->rx_limit) {
+		struct ustream_ratelimit *rl = s->rx_limit;
+
+		ustream_ratelimit_refill(rl);
+		if (rl->tokens < *maxlen && rl->tokens >= len)
+			*maxlen = rl->tokens;
+	}
+
 	return buf->tail;
 }
 
@@ -296,6 +824,13 @@ void ustream_fill_read(struct ustream *s, int len)
 	int maxlen;
 
 	s->r.data_bytes += len;
+	s->adaptive.burst += len;
+
+	if (s->rx_limit) {
+		s->rx_limit->tokens -= len;
+		if (ustream_ratelimit_wait(s, s->rx_limit))
+			__ustream_set_read_blocked(s, s->read_blocked | READ_BLOCKED_RATE);
+	}
 	do {
 		if (!buf)
 			abort();
@@ -333,63 +868,280 @@ char *ustream_get_read_buf(struct ustream *s, int *buflen)
 	return data;
 }
 
-static void ustream_write_error(struct ustream *s)
+int ustream_find_char(struct ustream *s, int c, int offset)
 {
-	if (!s->write_error)
-		ustream_state_change(s);
-	s->write_error = true;
+	struct ustream_buf *buf;
+	int pos = 0;
+
+	for (buf = s->r.head; buf && pos < s->r.data_bytes; buf = buf->next) {
+		int len = buf->tail - buf->data;
+		int start = offset - pos;
+		char *match;
+
+		if (start < 0)
+			start = 0;
+
+		if (start < len) {
+			match = memchr(buf->data + start, c, len - start);
+			if (match)
+				return pos + (match - buf->data);
+		}
+
+		pos += len;
+	}
+
+	return -1;
 }
 
-bool ustream_write_pending(struct ustream *s)
+char *ustream_peek(struct ustream *s, int len)
 {
-	struct ustream_buf *buf = s->w.head;
-	int wr = 0, len;
+	struct ustream_buf_list *l = &s->r;
+	struct ustream_buf *buf = l->head, *new;
+	int buflen, cur;
 
-	if (s->write_error)
-		return false;
+	if (len <= 0 || len > l->data_bytes)
+		return NULL;
 
-	while (buf && s->w.data_bytes) {
+	cur = buf->tail - buf->data;
+	if (cur >= len)
+		return buf->data;
+
+	/*
+	 * merge into the head buffer if it is large enough, otherwise replace
+	 * it with a larger one. either way, the number of read buffers does
+	 * not grow, so max_buffers and READ_BLOCKED_FULL stay accurate.
+	 */
+	if (buf->end - buf->head >= len && !buf->release) {
+		new = buf;
+		memmove(new->head, new->data, cur);
+		new->data = new->head;
+		new->tail = new->data + cur;
+	} else {
+		buflen = len > l->buffer_len ? len : l->buffer_len;
+		new = malloc(sizeof(*new) + buflen + s->string_data);
+		if (!new)
+			return NULL;
+
+		ustream_trace(s, USTREAM_TRACE_ALLOC, buflen);
+
+		ustream_init_buf(new, buflen);
+		memcpy(new->tail, buf->data, cur);
+		new->tail += cur;
+		new->next = buf->next;
+
+		l->head = new;
+		if (buf == l->data_tail)
+			l->data_tail = new;
+		if (buf == l->tail)
+			l->tail = new;
+		ustream_release_buf(s, l, buf);
+	}
+	len -= cur;
+
+	/* pull in the rest from the following buffers */
+	buf = new->next;
+	while (len) {
 		struct ustream_buf *next = buf->next;
-		int maxlen = buf->tail - buf->data;
 
-		len = s->write(s, buf->data, maxlen, !!buf->next);
-		if (len < 0) {
-			ustream_write_error(s);
-			break;
-		}
+		cur = buf->tail - buf->data;
+		if (cur > len)
+			cur = len;
 
-		if (len == 0)
-			break;
+		memcpy(new->tail, buf->data, cur);
+		new->tail += cur;
+		buf->data += cur;
+		len -= cur;
 
-		wr += len;
-		s->w.data_bytes -= len;
-		if (len < maxlen) {
-			buf->data += len;
+		if (buf->data != buf->tail)
 			break;
-		}
 
-		ustream_free_buf(&s->w, buf);
+		new->next = next;
+		if (buf == l->data_tail)
+			l->data_tail = new;
+		if (buf == l->tail)
+			l->tail = new;
+		l->buffers--;
+		ustream_release_buf(s, l, buf);
 		buf = next;
 	}
 
-	if (s->notify_write)
-		s->notify_write(s, wr);
-
-	if (s->eof && wr && !s->w.data_bytes)
-		ustream_state_change(s);
+	ustream_fixup_string(s, new);
 
-	return !s->w.data_bytes;
+	return new->data;
 }
 
-static int ustream_write_buffered(struct ustream *s, const char *data, int len, int wr)
+char *ustream_get_line(struct ustream *s, int *len)
 {
-	struct ustream_buf_list *l = &s->w;
-	struct ustream_buf *buf;
-	int maxlen;
+	int offset = ustream_find_char(s, '\n', 0);
 
-	while (len) {
-		if (!ustream_prepare_buf(s, &s->w, len))
-			break;
+	if (offset < 0)
+		return NULL;
+
+	*len = offset + 1;
+	return ustream_peek(s, *len);
+}
+
+static void ustream_write_error(struct ustream *s)
+{
+	if (!s->write_error) {
+		ustream_trace(s, USTREAM_TRACE_WRITE_ERROR, 0);
+		ustream_state_change(s);
+	}
+	s->write_error = true;
+}
+
+static int ustream_writev_buf(struct ustream *s, struct ustream_buf *buf, int *maxlen)
+{
+	struct iovec iov[USTREAM_IOV_MAX];
+	int n = 0;
+
+	*maxlen = 0;
+	while (buf && !buf->range && n < USTREAM_IOV_MAX) {
+		int len = buf->tail - buf->data;
+
+		if (!len)
+			break;
+
+		iov[n].iov_base = buf->data;
+		iov[n].iov_len = len;
+		*maxlen += len;
+		n++;
+
+		buf = buf->next;
+	}
+
+	return s->writev(s, iov, n, *maxlen < s->w.data_bytes);
+}
+
+/* remove len written bytes from the head of the write buffer list */
+static struct ustream_buf *ustream_write_done(struct ustream *s, struct ustream_buf *buf, int len)
+{
+	s->w.data_bytes -= len;
+	while (len) {
+		struct ustream_buf *next = buf->next;
+		struct ustream_range *r = buf->range;
+		int buf_len = r ? r->len : buf->tail - buf->data;
+
+		if (buf_len > len)
+			buf_len = len;
+
+		if (r) {
+			r->len -= buf_len;
+			if (r->sent)
+				r->sent(r, buf_len);
+		} else {
+			buf->data += buf_len;
+		}
+
+		len -= buf_len;
+		if (r ? r->len : buf->tail != buf->data)
+			break;
+
+		ustream_free_buf(s, &s->w, buf);
+		buf = next;
+	}
+
+	return buf;
+}
+
+/* data can be passed to the write callback right away */
+static bool ustream_can_write_direct(struct ustream *s)
+{
+	if (!s->tx_limit)
+		return !s->w.data_bytes && !s->corked;
+
+	/* rate limited data is always flushed from the rate timer */
+	if (!s->throttled && !s->corked &&
+	    (!s->rate_timer.pending || uloop_timeout_remaining(&s->rate_timer) > 0))
+		uloop_timeout_set(&s->rate_timer, 0);
+
+	return false;
+}
+
+bool ustream_write_pending(struct ustream *s)
+{
+	struct ustream_buf *buf = s->w.head;
+	int wr = 0, len;
+
+	if (s->write_error || s->corked)
+		return false;
+
+	s->throttled = s->tx_limit && ustream_ratelimit_wait(s, s->tx_limit);
+	if (s->throttled)
+		return false;
+
+	while (buf && s->w.data_bytes) {
+		struct ustream_range *r = buf->range;
+		int maxlen;
+
+		if (r) {
+			maxlen = r->len;
+			len = s->write_fd(s, r->fd, r->offset >= 0 ? &r->offset : NULL,
+					  maxlen, maxlen < s->w.data_bytes);
+		} else if (s->writev) {
+			len = ustream_writev_buf(s, buf, &maxlen);
+		} else {
+			maxlen = buf->tail - buf->data;
+			len = s->write(s, buf->data, maxlen, maxlen < s->w.data_bytes);
+		}
+
+		if (len < 0) {
+			ustream_write_error(s);
+			break;
+		}
+
+		if (len == 0)
+			break;
+
+		wr += len;
+		buf = ustream_write_done(s, buf, len);
+
+		if (s->tx_limit) {
+			s->tx_limit->tokens -= len;
+			s->throttled = ustream_ratelimit_wait(s, s->tx_limit);
+			if (s->throttled)
+				break;
+		}
+
+		if (len < maxlen)
+			break;
+	}
+
+	if (s->notify_write)
+		s->notify_write(s, wr);
+
+	if (s->eof && wr && !s->w.data_bytes)
+		ustream_state_change(s);
+
+	return !s->w.data_bytes;
+}
+
+void ustream_cork(struct ustream *s, int timeout)
+{
+	s->corked = true;
+	if (timeout > 0 && !s->cork_timer.pending)
+		uloop_timeout_set(&s->cork_timer, timeout);
+}
+
+void ustream_uncork(struct ustream *s)
+{
+	if (!s->corked)
+		return;
+
+	s->corked = false;
+	uloop_timeout_cancel(&s->cork_timer);
+	ustream_write_pending(s);
+}
+
+static int ustream_write_buffered(struct ustream *s, const char *data, int len, int wr)
+{
+	struct ustream_buf_list *l = &s->w;
+	struct ustream_buf *buf;
+	int maxlen;
+
+	while (len) {
+		if (!ustream_prepare_buf(s, &s->w, len))
+			break;
 
 		buf = l->data_tail;
 
@@ -405,18 +1157,23 @@ static int ustream_write_buffered(struct ustream *s, const char *data, int len,
 		l->data_bytes += maxlen;
 	}
 
+	ustream_w_stats(s);
 	return wr;
 }
 
+static int ustream_write_packet(struct ustream *s, const char *data, int len, bool more);
+
 int ustream_write(struct ustream *s, const char *data, int len, bool more)
 {
-	struct ustream_buf_list *l = &s->w;
 	int wr = 0;
 
 	if (s->write_error)
 		return 0;
 
-	if (!l->data_bytes) {
+	if (s->packet)
+		return ustream_write_packet(s, data, len, more);
+
+	if (ustream_can_write_direct(s)) {
 		wr = s->write(s, data, len, more);
 		if (wr == len)
 			return wr;
@@ -433,69 +1190,452 @@ int ustream_write(struct ustream *s, const char *data, int len, bool more)
 	return ustream_write_buffered(s, data, len, wr);
 }
 
-#define MAX_STACK_BUFLEN	256
+/*
+ * insert a buffer right behind the last buffer holding data, so that it is
+ * sent after everything that is already pending, and everything written
+ * later goes behind it
+ */
+static void ustream_insert_buf(struct ustream_buf_list *l, struct ustream_buf *buf)
+{
+	struct ustream_buf *prev = l->data_tail;
 
-int ustream_vprintf(struct ustream *s, const char *format, va_list arg)
+	if (prev && prev->tail == prev->data && !prev->range) {
+		struct ustream_buf *cur = l->head;
+
+		if (cur == prev) {
+			prev = NULL;
+		} else {
+			while (cur->next != prev)
+				cur = cur->next;
+			prev = cur;
+		}
+	}
+
+	l->buffers++;
+	if (prev) {
+		buf->next = prev->next;
+		prev->next = buf;
+	} else {
+		buf->next = l->head;
+		l->head = buf;
+	}
+
+	if (!buf->next)
+		l->tail = buf;
+	l->data_tail = buf;
+}
+
+/* message preserving write: each message is queued in a buffer of its own */
+static int ustream_write_packet(struct ustream *s, const char *data, int len, bool more)
 {
 	struct ustream_buf_list *l = &s->w;
-	char *buf;
-	va_list arg2;
-	int wr, maxlen, buflen;
+	struct ustream_buf *buf;
+	int wr;
 
-	if (s->write_error)
+	if (!len)
 		return 0;
 
-	if (!l->data_bytes) {
-		buf = alloca(MAX_STACK_BUFLEN);
-		va_copy(arg2, arg);
-		maxlen = vsnprintf(buf, MAX_STACK_BUFLEN, format, arg2);
-		va_end(arg2);
-		if (maxlen < MAX_STACK_BUFLEN) {
-			wr = s->write(s, buf, maxlen, false);
-			if (wr < 0) {
-				ustream_write_error(s);
-				return wr;
-			}
-			if (wr == maxlen)
-				return wr;
-
-			buf += wr;
-			maxlen -= wr;
-			return ustream_write_buffered(s, buf, maxlen, wr);
-		} else {
-			buf = malloc(maxlen + 1);
-			wr = vsnprintf(buf, maxlen + 1, format, arg);
-			wr = ustream_write(s, buf, wr, false);
-			free(buf);
+	if (ustream_can_write_direct(s)) {
+		wr = s->write(s, data, len, more);
+		if (wr < 0) {
+			ustream_write_error(s);
 			return wr;
 		}
+
+		if (wr)
+			return wr;
+	}
+
+	if (!ustream_can_alloc(l))
+		return 0;
+
+	buf = malloc(sizeof(*buf) + len);
+	if (!buf)
+		return 0;
+
+	ustream_trace(s, USTREAM_TRACE_ALLOC, len);
+	ustream_init_buf(buf, len);
+	memcpy(buf->data, data, len);
+	buf->tail = buf->end;
+	ustream_insert_buf(l, buf);
+	l->data_bytes += len;
+	ustream_mem_update(len);
+	ustream_w_stats(s);
+
+	return len;
+}
+
+int ustream_write_range(struct ustream *s, struct ustream_range *r, bool more)
+{
+	struct ustream_buf_list *l = &s->w;
+	struct ustream_range *range;
+	struct ustream_buf *buf;
+	off_t offset = r->offset;
+	int len = r->len;
+	int wr = 0;
+
+	if (!s->write_fd || s->write_error)
+		goto out;
+
+	if (ustream_can_write_direct(s)) {
+		wr = s->write_fd(s, r->fd, offset >= 0 ? &offset : NULL, len, more);
+		if (wr < 0) {
+			ustream_write_error(s);
+			goto out;
+		}
+
+		len -= wr;
+		if (wr && r->sent)
+			r->sent(r, wr);
+
+		if (!len)
+			goto out;
+	}
+
+	buf = calloc(1, sizeof(*buf) + sizeof(*range));
+	if (!buf)
+		goto out;
+
+	range = (struct ustream_range *) buf->head;
+	*range = *r;
+	range->offset = offset;
+	range->len = len;
+
+	buf->data = buf->tail = buf->end = buf->head;
+	buf->range = range;
+	ustream_insert_buf(l, buf);
+	l->data_bytes += len;
+	ustream_trace(s, USTREAM_TRACE_ALLOC, 0);
+	ustream_w_stats(s);
+
+	return r->len;
+
+out:
+	/* tell release how much has not been sent */
+	r->len = len;
+	if (r->release)
+		r->release(r);
+
+	if (!s->write_fd)
+		return -1;
+
+	return wr;
+}
+
+static void ustream_release_none(void *priv)
+{
+}
+
+int ustream_write_ext(struct ustream *s, const char *data, int len, bool more,
+		      void (*release)(void *priv), void *priv)
+{
+	struct ustream_buf_list *l = &s->w;
+	struct ustream_buf *buf;
+	int wr = 0;
+
+	if (s->write_error)
+		goto out;
+
+	if (ustream_can_write_direct(s)) {
+		wr = s->write(s, data, len, more);
+		if (wr < 0) {
+			ustream_write_error(s);
+			goto out;
+		}
+
+		if (wr == len)
+			goto out;
+	}
+
+	buf = calloc(1, sizeof(*buf));
+	if (!buf)
+		goto out;
+
+	buf->data = (char *) data + wr;
+	buf->tail = buf->end = (char *) data + len;
+	buf->release = release ? release : ustream_release_none;
+	buf->priv = priv;
+	ustream_insert_buf(l, buf);
+	l->data_bytes += len - wr;
+	ustream_trace(s, USTREAM_TRACE_ALLOC, 0);
+	ustream_w_stats(s);
+
+	return len;
+
+out:
+	if (release)
+		release(priv);
+
+	return wr;
+}
+
+static bool ustream_forward_can_move(struct ustream *src, struct ustream_buf *buf, int len)
+{
+	if (src->r.alloc != ustream_alloc_default || buf->release)
+		return false;
+
+	/* copy small chunks, so that they can be coalesced */
+	return len >= (buf->end - buf->head) / 2;
+}
+
+/* move the head buffer of the read list of src to the write list of dst */
+static void ustream_forward_move(struct ustream *src, struct ustream *dst)
+{
+	struct ustream_buf_list *l = &src->r;
+	struct ustream_buf *buf = l->head;
+	int len = buf->tail - buf->data;
+
+	l->head = buf->next;
+	if (buf == l->data_tail)
+		l->data_tail = buf->next;
+	if (buf == l->tail)
+		l->tail = NULL;
+	l->buffers--;
+	l->data_bytes -= len;
+
+	ustream_insert_buf(&dst->w, buf);
+	dst->w.data_bytes += len;
+	ustream_mem_update(buf->end - buf->head);
+	ustream_w_stats(dst);
+
+	if (!l->data_bytes && src->adaptive.enabled)
+		ustream_adaptive_drained(src);
+
+	__ustream_set_read_blocked(src, src->read_blocked & ~READ_BLOCKED_FULL);
+}
+
+static bool ustream_forward_buf(struct ustream_forward *f)
+{
+	struct ustream *src = f->src, *dst = f->dst;
+	struct ustream_buf *buf = src->r.head;
+	int len = buf->tail - buf->data;
+	bool more = src->r.data_bytes > len;
+	int wr;
+
+	if (!ustream_forward_can_move(src, buf, len)) {
+		wr = ustream_write(dst, buf->data, len, more);
+		if (wr > 0)
+			ustream_consume(src, wr);
+
+		return wr == len;
+	}
+
+	if (ustream_can_write_direct(dst)) {
+		wr = dst->write(dst, buf->data, len, more);
+		if (wr < 0) {
+			ustream_write_error(dst);
+			return false;
+		}
+
+		ustream_consume(src, wr);
+		if (wr == len)
+			return true;
+	}
+
+	ustream_forward_move(src, dst);
+	return true;
+}
+
+static void ustream_forward_data(struct ustream_forward *f)
+{
+	struct ustream *src = f->src, *dst = f->dst;
+	unsigned char val;
+
+	while (src->r.data_bytes && !dst->write_error &&
+	       dst->w.data_bytes < f->max_pending) {
+		if (!ustream_forward_buf(f))
+			break;
+	}
+
+	val = src->read_blocked & ~READ_BLOCKED_FORWARD;
+	if (dst->w.data_bytes >= f->max_pending)
+		val |= READ_BLOCKED_FORWARD;
+
+	__ustream_set_read_blocked(src, val);
+}
+
+static void ustream_forward_notify_read(struct ustream *s, int bytes)
+{
+	ustream_forward_data(s->fwd_read);
+}
+
+static void ustream_forward_notify_write(struct ustream *s, int bytes)
+{
+	ustream_forward_data(s->fwd_write);
+}
+
+void ustream_forward_init(struct ustream_forward *f, struct ustream *src,
+			  struct ustream *dst)
+{
+	if (!f->max_pending)
+		f->max_pending = USTREAM_FORWARD_PENDING;
+
+	f->src = src;
+	f->dst = dst;
+	src->fwd_read = f;
+	src->notify_read = ustream_forward_notify_read;
+	dst->fwd_write = f;
+	dst->notify_write = ustream_forward_notify_write;
+
+	ustream_forward_data(f);
+}
+
+void ustream_forward_stop(struct ustream_forward *f)
+{
+	struct ustream *src = f->src, *dst = f->dst;
+
+	if (!src)
+		return;
+
+	src->fwd_read = NULL;
+	src->notify_read = NULL;
+	dst->fwd_write = NULL;
+	dst->notify_write = NULL;
+	f->src = f->dst = NULL;
+
+	__ustream_set_read_blocked(src, src->read_blocked & ~READ_BLOCKED_FORWARD);
+}
+
+static void ustream_release_file(struct ustream_range *r)
+{
+	close(r->fd);
+}
+
+static int ustream_write_file_buffered(struct ustream *s, int fd, off_t offset, int len, bool more)
+{
+	char buf[4096];
+	int wr = 0;
+
+	while (len) {
+		ssize_t cur = len > sizeof(buf) ? sizeof(buf) : len;
+
+		cur = pread(fd, buf, cur, offset);
+		if (cur <= 0)
+			return -1;
+
+		cur = ustream_write(s, buf, cur, more || cur < len);
+		if (cur < 0)
+			return cur;
+
+		offset += cur;
+		len -= cur;
+		wr += cur;
 	}
 
-	if (!ustream_prepare_buf(s, l, 1))
+	return wr;
+}
+
+int ustream_write_file(struct ustream *s, int fd, off_t offset, int len, bool more)
+{
+	struct ustream_range r = {
+		.offset = offset,
+		.len = len,
+		.release = ustream_release_file,
+	};
+
+	if (s->write_error)
+		return 0;
+
+	if (!s->write_fd)
+		return ustream_write_file_buffered(s, fd, offset, len, more);
+
+	r.fd = dup(fd);
+	if (r.fd < 0)
+		return -1;
+
+	return ustream_write_range(s, &r, more);
+}
+
+/* formatted output shorter than this should not need a second pass */
+#define USTREAM_PRINTF_MIN	64
+
+/*
+ * get a write buffer with at least len bytes of free space, if possible
+ * without allocating a new buffer
+ */
+static struct ustream_buf *ustream_printf_buf(struct ustream *s, int len)
+{
+	struct ustream_buf_list *l = &s->w;
+	struct ustream_buf *buf;
+
+	if (!ustream_prepare_buf(s, l, len))
+		return NULL;
+
+	buf = l->data_tail;
+	if (buf->end - buf->tail >= len || buf->tail == buf->data)
+		return buf;
+
+	if (buf->next)
+		l->data_tail = buf->next;
+	else if (ustream_can_alloc(l) && l->alloc(s, l) == 0)
+		l->data_tail = l->tail;
+
+	return l->data_tail;
+}
+
+int ustream_vprintf(struct ustream *s, const char *format, va_list arg)
+{
+	struct ustream_buf_list *l = &s->w;
+	struct ustream_buf *buf;
+	bool direct;
+	va_list arg2;
+	char *str;
+	int wr, len, buflen;
+
+	if (s->write_error)
 		return 0;
 
-	buf = l->data_tail->tail;
-	buflen = l->data_tail->end - buf;
+	if (s->packet) {
+		if (vasprintf(&str, format, arg) < 0)
+			return 0;
 
+		wr = ustream_write(s, str, strlen(str), false);
+		free(str);
+		return wr;
+	}
+
+	direct = ustream_can_write_direct(s);
+	buf = ustream_printf_buf(s, USTREAM_PRINTF_MIN);
+	if (!buf)
+		return 0;
+
+	buflen = buf->end - buf->tail;
 	va_copy(arg2, arg);
-	maxlen = vsnprintf(buf, buflen, format, arg2);
+	len = vsnprintf(buf->tail, buflen, format, arg2);
 	va_end(arg2);
 
-	wr = maxlen;
-	if (wr >= buflen)
-		wr = buflen - 1;
+	if (len <= 0)
+		return 0;
 
-	l->data_tail->tail += wr;
-	l->data_bytes += wr;
-	if (maxlen < buflen)
+	if (len >= buflen) {
+		/* format once more, into a buffer of its own */
+		buf = malloc(sizeof(*buf) + len + 1);
+		if (!buf)
+			return 0;
+
+		ustream_trace(s, USTREAM_TRACE_ALLOC, len);
+		ustream_init_buf(buf, len);
+		vsnprintf(buf->tail, len + 1, format, arg);
+		ustream_insert_buf(l, buf);
+		ustream_mem_update(len);
+	}
+
+	buf->tail += len;
+	l->data_bytes += len;
+	ustream_w_stats(s);
+	if (!direct)
+		return len;
+
+	wr = s->write(s, buf->data, len, false);
+	if (wr < 0) {
+		ustream_write_error(s);
 		return wr;
+	}
 
-	buf = malloc(maxlen + 1);
-	maxlen = vsnprintf(buf, maxlen + 1, format, arg);
-	wr = ustream_write_buffered(s, buf + wr, maxlen - wr, wr);
-	free(buf);
+	if (wr > 0)
+		ustream_write_done(s, buf, wr);
 
-	return wr;
+	return len;
 }
 
 int ustream_printf(struct ustream *s, const char *format, ...)
@@ -512,3 +1652,172 @@ int ustream_printf(struct ustream *s, const char *format, ...)
 
 	return ret;
 }
+
+static const char ustream_digits[200] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* format val right-aligned, ending at end */
+static char *ustream_format_uint(char *end, unsigned long long val)
+{
+	char *p = end;
+
+	while (val >= 100) {
+		const char *d = &ustream_digits[(val % 100) * 2];
+
+		val /= 100;
+		*--p = d[1];
+		*--p = d[0];
+	}
+
+	if (val >= 10) {
+		const char *d = &ustream_digits[val * 2];
+
+		*--p = d[1];
+		*--p = d[0];
+	} else {
+		*--p = '0' + val;
+	}
+
+	return p;
+}
+
+int ustream_write_uint(struct ustream *s, unsigned long long val)
+{
+	char buf[24], *end = buf + sizeof(buf);
+	char *p = ustream_format_uint(end, val);
+
+	return ustream_write(s, p, end - p, false);
+}
+
+int ustream_write_int(struct ustream *s, long long val)
+{
+	char buf[24], *end = buf + sizeof(buf);
+	char *p;
+
+	if (val >= 0)
+		return ustream_write_uint(s, val);
+
+	p = ustream_format_uint(end, -(unsigned long long) val);
+	*--p = '-';
+
+	return ustream_write(s, p, end - p, false);
+}
+
+int ustream_write_hex(struct ustream *s, unsigned long long val, int width)
+{
+	static const char hex[] = "0123456789abcdef";
+	char buf[16], *end = buf + sizeof(buf);
+	char *p = end;
+
+	do {
+		*--p = hex[val & 0xf];
+		val >>= 4;
+	} while (val);
+
+	while (p > buf && end - p < width)
+		*--p = '0';
+
+	return ustream_write(s, p, end - p, false);
+}
+
+static int ustream_escape_char(char *buf, unsigned char c)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	buf[0] = '\\';
+	switch (c) {
+	case '"':
+	case '\\':
+		buf[1] = c;
+		return 2;
+	case '\b':
+		buf[1] = 'b';
+		return 2;
+	case '\f':
+		buf[1] = 'f';
+		return 2;
+	case '\n':
+		buf[1] = 'n';
+		return 2;
+	case '\r':
+		buf[1] = 'r';
+		return 2;
+	case '\t':
+		buf[1] = 't';
+		return 2;
+	default:
+		memcpy(buf + 1, "u00", 3);
+		buf[4] = hex[c >> 4];
+		buf[5] = hex[c & 0xf];
+		return 6;
+	}
+}
+
+static int ustream_write_count(struct ustream *s, const char *data, int len,
+				bool more, int *total)
+{
+	int wr = ustream_write(s, data, len, more);
+
+	if (wr < 0)
+		return -1;
+
+	*total += wr;
+	return 0;
+}
+
+int ustream_write_escaped(struct ustream *s, const char *str, int len)
+{
+	char buf[256];
+	int n = 0, ret = 0;
+
+	if (len < 0)
+		len = strlen(str);
+
+	while (len > 0) {
+		int run = 0;
+
+		while (run < len) {
+			unsigned char c = str[run];
+
+			if (c < 0x20 || c == '"' || c == '\\')
+				break;
+			run++;
+		}
+
+		if (run > sizeof(buf) - n) {
+			/* long runs are passed on without copying */
+			if (n && ustream_write_count(s, buf, n, true, &ret))
+				return -1;
+			if (ustream_write_count(s, str, run, len > run, &ret))
+				return -1;
+			n = 0;
+		} else {
+			memcpy(buf + n, str, run);
+			n += run;
+		}
+
+		str += run;
+		len -= run;
+		if (!len)
+			break;
+
+		if (n > sizeof(buf) - 6) {
+			if (ustream_write_count(s, buf, n, true, &ret))
+				return -1;
+			n = 0;
+		}
+
+		n += ustream_escape_char(buf + n, *str);
+		str++;
+		len--;
+	}
+
+	if (n && ustream_write_count(s, buf, n, false, &ret))
+		return -1;
+
+	return ret;
+}
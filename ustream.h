@@ -19,15 +19,24 @@
 #ifndef __USTREAM_H
 #define __USTREAM_H
 
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <stdarg.h>
 #include "uloop.h"
 
+struct blob_attr;
+struct blob_buf;
+struct blobmsg_json_parser;
+
 struct ustream;
 struct ustream_buf;
 
 enum read_blocked_reason {
 	READ_BLOCKED_USER = (1 << 0),
 	READ_BLOCKED_FULL = (1 << 1),
+	READ_BLOCKED_MEM = (1 << 2),
+	READ_BLOCKED_RATE = (1 << 3),
+	READ_BLOCKED_FORWARD = (1 << 4),
 };
 
 struct ustream_buf_list {
@@ -44,11 +53,111 @@ struct ustream_buf_list {
 	int buffer_len;
 
 	int buffers;
+
+	/* set by ustream_set_read_ring: single double-mapped ring buffer */
+	bool ring;
+	int ring_map_len;
+};
+
+struct ustream_adaptive {
+	bool enabled;
+
+	/* read data was consumed since the idle timer was armed */
+	bool active;
+
+	/* initial read buffer size and count, restored when scaling down */
+	int min_len;
+	int max_buffers;
+
+	/* bytes received since the read buffers were last drained */
+	int burst;
+	/* largest burst since the read buffers were last released */
+	int peak;
+
+	struct uloop_timeout idle;
+
+	unsigned int grow;
+	unsigned int shrink;
+};
+
+struct ustream_adaptive_stats {
+	unsigned int streams;
+
+	unsigned long grow;
+	unsigned long shrink;
+};
+
+extern struct ustream_adaptive_stats ustream_adaptive_stats;
+
+/*
+ * token bucket for ustream_set_ratelimit. can be shared between multiple
+ * streams to limit the bandwidth of a group of connections
+ */
+struct ustream_ratelimit {
+	unsigned int rate;	/* bytes per second */
+	unsigned int burst;	/* bucket size in bytes */
+
+	long long tokens;
+	long long last;
+};
+
+enum ustream_trace_event {
+	USTREAM_TRACE_ALLOC,		/* val: buffer size */
+	USTREAM_TRACE_READ_FULL,	/* val: pending read data */
+	USTREAM_TRACE_WRITE_ERROR,
+};
+
+/* per-stream counters, enabled by pointing s->stats to an instance */
+struct ustream_stats {
+	/* (optional) used to identify the stream in ustream_dump */
+	const char *name;
+
+	unsigned long long rx_bytes, tx_bytes;
+	unsigned long rx_calls, tx_calls;	/* syscalls */
+
+	unsigned long allocs;			/* buffer allocations */
+	unsigned long long moved;		/* bytes moved by memmove */
+	unsigned long read_full;		/* read buffers filled up */
+	unsigned long write_errors;
+
+	int max_w_bytes;
+	int max_w_buffers;
+
+	/* (optional) called for every event that is counted */
+	void (*trace)(struct ustream *s, enum ustream_trace_event ev, int val);
+};
+
+struct ustream_range {
+	int fd;
+	off_t offset;	/* -1 for pipes */
+	int len;
+
+	/* (optional) called after len bytes of the range have been sent */
+	void (*sent)(struct ustream_range *r, int len);
+
+	/*
+	 * (optional) called when the range is sent completely or discarded,
+	 * len is the number of bytes that have not been sent
+	 */
+	void (*release)(struct ustream_range *r);
+
+	void *priv;
+};
+
+/* see ustream_forward_init */
+struct ustream_forward {
+	struct ustream *src, *dst;
+
+	/* reading from src is blocked while dst has more data queued (default: 64k) */
+	int max_pending;
 };
 
 struct ustream {
+	struct list_head list;
 	struct ustream_buf_list r, w;
 	struct uloop_timeout state_change;
+	struct uloop_timeout cork_timer;
+	struct uloop_timeout rate_timer;
 	struct ustream *next;
 
 	/*
@@ -87,6 +196,24 @@ struct ustream {
 	 */
 	int (*write)(struct ustream *s, const char *buf, int len, bool more);
 
+	/*
+	 * writev: (optional)
+	 * defined by ustream implementation, same as write, but accepts
+	 * multiple buffers at once. used for flushing the write buffers.
+	 * on packet streams, each iovec holds one message.
+	 */
+	int (*writev)(struct ustream *s, const struct iovec *iov, int iovcnt, bool more);
+
+	/*
+	 * write_fd: (optional)
+	 * defined by ustream implementation, sends up to len bytes directly
+	 * from fd without copying them through user space. reads from *offset
+	 * (and updates it), or from the current position of fd if offset is
+	 * NULL (pipes).
+	 * returns the number of bytes accepted, or -1 on error
+	 */
+	int (*write_fd)(struct ustream *s, int fd, off_t *offset, int len, bool more);
+
 	/*
 	 * free: (optional)
 	 * defined by ustream implementation, tears down the ustream and frees data
@@ -108,20 +235,92 @@ struct ustream {
 	 */
 	bool (*poll)(struct ustream *s);
 
+	/*
+	 * consume: (optional)
+	 * defined by ustream implementation, called by ustream_consume after
+	 * data has been removed from the read buffers
+	 */
+	void (*consume)(struct ustream *s);
+
 	/*
 	 * ustream user should set this if the input stream is expected
 	 * to contain string data. the core will keep all data 0-terminated.
 	 */
 	bool string_data;
+
+	/*
+	 * set by ustream implementations that preserve message boundaries.
+	 * every write is passed to the write callback as a whole, or queued
+	 * in a write buffer of its own.
+	 */
+	bool packet;
+
 	bool write_error;
+	bool corked;
 	bool eof, eof_write_done;
 
+	/* set while the write side waits for the rate limit */
+	bool throttled;
+
 	enum read_blocked_reason read_blocked;
+
+	/* read buffer sizing state, see ustream_set_adaptive */
+	struct ustream_adaptive adaptive;
+
+	/* see ustream_set_ratelimit */
+	struct ustream_ratelimit *rx_limit, *tx_limit;
+
+	/* (optional) counters, maintained while set */
+	struct ustream_stats *stats;
+
+	/* set by ustream_forward_init, for forwarding from/to this stream */
+	struct ustream_forward *fwd_read, *fwd_write;
+
+	/* set by filter streams (e.g. ustream_zlib) layered on top of this one */
+	struct ustream *upper;
 };
 
 struct ustream_fd {
 	struct ustream stream;
 	struct uloop_fd fd;
+
+	/* set by ustream_fd_splice */
+	struct ustream_splice *splice;
+
+	bool socket;
+};
+
+struct ustream_dgram {
+	struct ustream stream;
+	struct uloop_fd fd;
+
+	bool seqpacket;
+
+	/* private: maximum message size, r.buffer_len adds the address */
+	int msg_len;
+};
+
+struct ustream_shm_ring;
+
+struct ustream_shm {
+	struct ustream stream;
+	struct uloop_fd fd;
+	int peer_fd;
+
+	struct ustream_shm_ring *rx, *tx;
+	char *rx_data, *tx_data;
+	uint32_t rx_pos;
+	int size;
+};
+
+struct ustream_mmap {
+	struct ustream stream;
+	struct uloop_timeout timer;
+
+	char *map;
+	size_t size;
+	size_t pos;		/* end of the data passed to the read buffers */
+	size_t dropped;		/* consumed pages released with madvise */
 };
 
 struct ustream_buf {
@@ -131,12 +330,149 @@ struct ustream_buf {
 	char *tail;
 	char *end;
 
+	/* write buffer sending a file range instead of inline data */
+	struct ustream_range *range;
+
+	/* buffer with external data, called when the buffer is freed */
+	void (*release)(void *priv);
+	void *priv;
+
 	char head[];
 };
 
 /* ustream_fd_init: create a file descriptor ustream (uses uloop) */
 void ustream_fd_init(struct ustream_fd *s, int fd);
 
+/*
+ * ustream_fd_splice: forward all data received on sf to dst using splice()
+ *
+ * incoming data bypasses the read buffers of sf and is queued in the write
+ * buffers of dst through a pipe, without being copied to user space.
+ * ordering with other data written to dst is preserved.
+ * dst must support write_fd (i.e. be a ustream_fd), passing NULL stops
+ * forwarding. dst is not tracked: forwarding must be stopped before dst
+ * is freed. if dst fails to accept data (e.g. after a write error),
+ * forwarding is stopped and notify_state is called on sf. data discarded
+ * by dst is released from the pipe accounting, so sf is not blocked by it.
+ * data already in the read buffer of sf is written to dst first. if dst
+ * does not take all of it, forwarding is not started and the rest stays
+ * in the read buffer.
+ * returns 0 on success, -1 on error
+ */
+int ustream_fd_splice(struct ustream_fd *sf, struct ustream *dst);
+
+/*
+ * ustream_dgram_init: create a message based ustream for a datagram or
+ * seqpacket socket (uses uloop)
+ *
+ * each read buffer holds one received message, ustream_get_read_buf
+ * never returns data from more than one message. r.buffer_len sets the
+ * maximum message size (default 2048), longer messages are truncated.
+ * init adds the space for the sender address to it, calling init again
+ * keeps the message size.
+ * each ustream_write call sends one message, empty datagrams are ignored.
+ */
+void ustream_dgram_init(struct ustream_dgram *d, int fd);
+
+/* ustream_dgram_get_addr: source address of the first pending message */
+const struct sockaddr *ustream_dgram_get_addr(struct ustream_dgram *d, socklen_t *len);
+
+/*
+ * ustream_dgram_sendto: send a message to addr on an unconnected socket
+ *
+ * the message is not queued, returns -1 with errno set to EAGAIN if the
+ * socket send buffer is full.
+ */
+int ustream_dgram_sendto(struct ustream_dgram *d, const char *buf, int len,
+			 const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * ustream_shm_create: set up a shared memory transport between two processes
+ *
+ * allocates two rings of size bytes (one per direction) in a memfd and
+ * one eventfd per side for wakeups. fds[0] is the memfd, fds[1] and fds[2]
+ * are the eventfds of side 0 and 1. all three need to be passed to the
+ * peer process (e.g. by fork or SCM_RIGHTS), closing them is up to the caller
+ * once both sides have been initialized.
+ * returns 0 on success, -1 on error
+ */
+int ustream_shm_create(int size, int fds[3]);
+
+/*
+ * ustream_shm_init: create a ustream for one side of a shared memory
+ * transport (uses uloop)
+ *
+ * received data is passed to the reader in place, without copying it out
+ * of the shared ring. string_data is not supported.
+ * returns 0 on success, -1 on error
+ */
+int ustream_shm_init(struct ustream_shm *sh, int fds[3], int side);
+
+/*
+ * ustream_mmap_init: create a read-only ustream for a regular file
+ *
+ * the file is mapped into memory, read buffers point directly into the
+ * mapping. each read buffer covers up to r.buffer_len bytes of the file
+ * (default 64M), so that smaller files are passed as a single contiguous
+ * buffer. pages are released as the data is consumed, in steps of 1M
+ * (and whenever a read buffer is freed). string_data
+ * is not supported, writes fail. fd may be closed after this call.
+ * returns 0 on success, -1 on error (e.g. if fd is not a regular file)
+ */
+int ustream_mmap_init(struct ustream_mmap *m, int fd);
+
+/* ustream_for_each: call cb for every initialized stream (cb may free it) */
+void ustream_for_each(void (*cb)(struct ustream *s, void *priv), void *priv);
+
+/*
+ * ustream_dump: add the state and counters of all streams to a blob_buf
+ *
+ * adds an array named name, with one table per stream
+ */
+void ustream_dump(struct blob_buf *b, const char *name);
+
+/*
+ * ustream_blob_recv: extract complete blob messages from the read buffer
+ *
+ * calls cb for each message that has been received completely. messages
+ * are passed in place when they sit inside one read buffer, and are only
+ * copied when they span multiple buffers. the message is consumed when cb
+ * returns, cb must not free the stream.
+ * messages larger than max_len (or the read buffer limits) are rejected.
+ * the nested attributes of containers are bounds checked, along with their
+ * blobmsg headers. containers are blobmsg tables and arrays, and plain
+ * messages with id BLOB_ATTR_UNSPEC (the id of a blob_buf_init(b, 0) head)
+ * or BLOB_ATTR_NESTED. other messages are leaf values, passed unchecked.
+ * returns the number of messages handled, or -1 on an invalid message
+ * (the stream is out of sync and should be closed)
+ */
+int ustream_blob_recv(struct ustream *s, int max_len,
+		      void (*cb)(struct ustream *s, struct blob_attr *msg, void *priv),
+		      void *priv);
+
+/*
+ * ustream_json_recv: feed the read buffer to an incremental JSON parser
+ *
+ * data is consumed as it is parsed, so the document never has to be held
+ * in the read buffer as a whole. data following the end of the object is
+ * left in the read buffer.
+ * returns 1 once the object is complete, 0 if more data is needed, or -1
+ * on a syntax error
+ */
+int ustream_json_recv(struct ustream *s, struct blobmsg_json_parser *p);
+
+/* ustream_blob_write: send a blob message, including its padding */
+int ustream_blob_write(struct ustream *s, struct blob_attr *msg);
+
+/*
+ * ustream_blob_write_buf: send the contents of a blob_buf without copying
+ *
+ * the buffer is handed over to the write queue and freed once it has been
+ * sent, b needs to be initialized again before reuse. data in caller
+ * provided storage (blob_buf_init_external) is copied instead.
+ */
+int ustream_blob_write_buf(struct ustream *s, struct blob_buf *b);
+
 /* ustream_free: free all buffers and data associated with a ustream */
 void ustream_free(struct ustream *s);
 
@@ -148,9 +484,158 @@ int ustream_write(struct ustream *s, const char *buf, int len, bool more);
 int ustream_printf(struct ustream *s, const char *format, ...);
 int ustream_vprintf(struct ustream *s, const char *format, va_list arg);
 
+/* ustream_write_int, ustream_write_uint: write a decimal number */
+int ustream_write_int(struct ustream *s, long long val);
+int ustream_write_uint(struct ustream *s, unsigned long long val);
+
+/* ustream_write_hex: write a lowercase hex number, 0-padded to width digits */
+int ustream_write_hex(struct ustream *s, unsigned long long val, int width);
+
+/*
+ * ustream_write_escaped: write a string with quotes, backslashes and control
+ * characters escaped as in JSON (len < 0: 0-terminated)
+ * returns the number of bytes written after escaping, or -1 if a write
+ * failed (nothing further is written after the failure)
+ */
+int ustream_write_escaped(struct ustream *s, const char *str, int len);
+
+/*
+ * ustream_cork: hold back written data
+ *
+ * all data is kept in the write buffers until ustream_uncork is called,
+ * or after timeout msecs (if > 0), so that it can be sent in one go.
+ */
+void ustream_cork(struct ustream *s, int timeout);
+
+/* ustream_uncork: send all data that was held back by ustream_cork */
+void ustream_uncork(struct ustream *s);
+
+/*
+ * ustream_write_ext: add an external buffer to the write buffer
+ *
+ * the data is not copied and must stay valid until release(priv) has been
+ * called, which happens once after all of it has been accepted by the
+ * ustream implementation, or when the write buffers are discarded.
+ * when queueing the same data on multiple streams, use priv to keep a
+ * reference count.
+ */
+int ustream_write_ext(struct ustream *s, const char *buf, int len, bool more,
+		      void (*release)(void *priv), void *priv);
+
+/*
+ * ustream_forward_init: forward all data received on src to dst
+ *
+ * full read buffers of src are moved to the write buffers of dst instead of
+ * being copied, smaller chunks are copied (and coalesced). reading from src
+ * is blocked while more than f->max_pending bytes are waiting on dst.
+ * takes over src->notify_read and dst->notify_write, eof and write errors
+ * are still reported through notify_state and are up to the caller.
+ * for a pair of ustream_fd, ustream_fd_splice avoids copying the data
+ * through user space altogether.
+ */
+void ustream_forward_init(struct ustream_forward *f, struct ustream *src,
+			  struct ustream *dst);
+
+/* ustream_forward_stop: stop forwarding, data not forwarded yet stays in src */
+void ustream_forward_stop(struct ustream_forward *f);
+
+/*
+ * ustream_write_file: add a file range to the write buffer
+ *
+ * the data is sent using sendfile if the ustream supports it, and read
+ * into the write buffers otherwise. fd is duplicated, the caller may
+ * close it afterwards.
+ */
+int ustream_write_file(struct ustream *s, int fd, off_t offset, int len, bool more);
+
 /* ustream_get_read_buf: get a pointer to the next read buffer data */
 char *ustream_get_read_buf(struct ustream *s, int *buflen);
 
+/*
+ * ustream_set_mem_limit: limit the write buffer memory of all ustreams
+ *
+ * once the write buffers of all streams together use more than high bytes,
+ * reading is blocked on all streams (READ_BLOCKED_MEM) until the usage
+ * drops to low bytes again. notify (optional) is called whenever this
+ * state changes. high = 0 disables the limit.
+ * external buffers and file ranges are not accounted.
+ */
+void ustream_set_mem_limit(size_t high, size_t low, void (*notify)(bool blocked));
+
+/* ustream_mem_usage: get the write buffer memory used by all ustreams */
+size_t ustream_mem_usage(void);
+
+/*
+ * ustream_set_adaptive: size the read buffers based on the traffic
+ *
+ * when the read buffers fill up, the buffer size and number of buffers
+ * are doubled/increased (up to 64k and 8 buffers). once no data has been
+ * received for a second, the read buffers are freed, and their size is
+ * reduced again (down to the initial size) if only a small part of it was
+ * used. after another second without data, the initial size and number
+ * of buffers are restored.
+ * per-stream counters are kept in s->adaptive, global counters in
+ * ustream_adaptive_stats.
+ */
+void ustream_set_adaptive(struct ustream *s, bool enable);
+
+/*
+ * ustream_ratelimit_init: set up a token bucket
+ *
+ * rate is in bytes per second, burst is the amount of data that can be
+ * passed at once after an idle period (0: rate / 10)
+ */
+void ustream_ratelimit_init(struct ustream_ratelimit *rl, unsigned int rate,
+			    unsigned int burst);
+
+/*
+ * ustream_set_ratelimit: limit the bandwidth of a stream (NULL: unlimited)
+ *
+ * reads are paced with READ_BLOCKED_RATE, written data is always buffered
+ * and flushed by ustream_write_pending as far as the bucket allows.
+ * the same bucket can be used for several streams.
+ */
+void ustream_set_ratelimit(struct ustream *s, struct ustream_ratelimit *rx,
+			   struct ustream_ratelimit *tx);
+
+/*
+ * ustream_find_char: search the pending read data for a character
+ *
+ * looks at all read buffers, starting at offset.
+ * returns the offset of the first match, or -1 if not found
+ */
+int ustream_find_char(struct ustream *s, int c, int offset);
+
+/*
+ * ustream_peek: get contiguous access to pending read data
+ *
+ * returns a pointer to the first len bytes of pending data, or NULL if
+ * less data is available. the data is only copied if it spans multiple
+ * read buffers.
+ */
+char *ustream_peek(struct ustream *s, int len);
+
+/*
+ * ustream_get_line: get the next complete line of pending read data
+ *
+ * returns a pointer to the line (including the trailing newline) and
+ * stores its length in len, or returns NULL if no full line is available.
+ * use ustream_consume to remove the line afterwards.
+ */
+char *ustream_get_line(struct ustream *s, int *len);
+
+/*
+ * ustream_set_read_ring: use a ring buffer for the read side
+ *
+ * replaces the read buffer chain with a single ring buffer of at least
+ * len bytes, which is mapped twice in a row. pending data is always
+ * contiguous and consuming it never needs to move any data.
+ * must be called after the ustream has been initialized, but before any
+ * data has been received.
+ * returns 0 on success, -1 if not supported by the system
+ */
+int ustream_set_read_ring(struct ustream *s, int len);
+
 /*
  * ustream_set_read_blocked: set read blocked state
  *
@@ -172,7 +657,7 @@ static inline int ustream_pending_data(struct ustream *s, bool write)
 static inline bool ustream_read_buf_full(struct ustream *s)
 {
 	struct ustream_buf *buf = s->r.data_tail;
-	return buf && buf->data == buf->head && buf->tail == buf->end &&
+	return buf && (buf->data == buf->head || s->r.ring) && buf->tail == buf->end &&
 	       s->r.buffers == s->r.max_buffers;
 }
 
@@ -192,6 +677,16 @@ char *ustream_reserve(struct ustream *s, int len, int *maxlen);
 /* ustream_fill_read: mark rx buffer space as filled */
 void ustream_fill_read(struct ustream *s, int len);
 
+/*
+ * ustream_write_range: add data from a file descriptor to the write buffer
+ *
+ * requires write_fd. the range is copied, r->release is called once it
+ * has been sent completely or the write buffers have been discarded.
+ * r->len is updated if release is called before returning.
+ * returns the number of bytes accepted, or -1 on error
+ */
+int ustream_write_range(struct ustream *s, struct ustream_range *r, bool more);
+
 /*
  * ustream_write_pending: attempt to write more data from write buffers
  * returns true if all write buffers have been emptied.
@@ -203,6 +698,30 @@ static inline void ustream_state_change(struct ustream *s)
 	uloop_timeout_set(&s->state_change, 0);
 }
 
+/* ustream_trace: count an event in s->stats and pass it to the trace hook */
+void ustream_trace(struct ustream *s, enum ustream_trace_event ev, int val);
+
+/* ustream_stats_rx, ustream_stats_tx: count a syscall and the data it moved */
+static inline void ustream_stats_rx(struct ustream *s, int len)
+{
+	if (!s->stats)
+		return;
+
+	s->stats->rx_calls++;
+	if (len > 0)
+		s->stats->rx_bytes += len;
+}
+
+static inline void ustream_stats_tx(struct ustream *s, int len)
+{
+	if (!s->stats)
+		return;
+
+	s->stats->tx_calls++;
+	if (len > 0)
+		s->stats->tx_bytes += len;
+}
+
 static inline bool ustream_poll(struct ustream *s)
 {
 	if (!s->poll)